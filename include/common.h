@@ -4,45 +4,207 @@
 #include <memory>
 #include <functional>
 #include <thread>
+#include <vector>
+#include <cstdint>
+#include <atomic>
 
-#define LOG_(ARGS, cc) {std::ostringstream sstr; sstr << ARGS; trace_log(sstr.str(), cc);}
-#define LOG(ARGS) LOG_(ARGS, false)
-#define LOG_CONS(ARGS) LOG_(ARGS, true)
+// arguments are not evaluated if the level is filtered out
+#define LOG_(LEVEL, ARGS, cc) {if (log_enabled(LEVEL)) {std::ostringstream sstr; sstr << ARGS; trace_log(sstr.str(), cc);}}
+#define LOG(ARGS) LOG_(mstream::log_level::info, ARGS, false)
+#define LOG_CONS(ARGS) LOG_(mstream::log_level::error, ARGS, true)
+#define LOGD(ARGS) LOG_(mstream::log_level::debug, ARGS, false)
 #define THROW_ERR(ARGS) {std::ostringstream sstr; sstr << ARGS; throw std::logic_error(sstr.str());}
 
-#ifndef NDEBUG
-#define LOGD(ARGS) LOG(ARGS)
-#else
-#define LOGD(ARGS)
-#endif
-/*#undef LOG
-#define LOG(ARGS)*/
-
 #define MANDATORY_PTR(ptr) ptr?ptr:throw std::logic_error("Mandatory ptr is null: "#ptr)
 #define DECLARE_PTR_S(name) struct name; typedef std::shared_ptr<name> name##Ptr;
 
 namespace mstream
 {
+enum class log_level
+{
+    error,  // also everything copied to console
+    info,
+    debug,
+};
+
+extern std::atomic<int> g_log_level;
+
+inline bool log_enabled(log_level level)
+{
+    return (int)level <= g_log_level.load(std::memory_order_relaxed);
+}
+
+void set_log_level(log_level level);
+bool parse_log_level(const std::string& name, log_level& level);
+
+// starts background writer of mstream.log
 void initialize_log();
+// writes what is queued and stops the writer, later records are lost
+void shutdown_log();
+// the record goes to the ring of the calling thread, the file is written by the log writer
 void trace_log(const std::string& str, bool copy_to_console = false);
 
+// cpu time consumed by the calling thread
+int64_t thread_cpu_us();
+
+// local time with milliseconds for file names, 20240131_235959_123
+std::string file_time_stamp();
+
+enum class queue_full_policy
+{
+    block,  // decoder waits for the consumer
+    drop,   // decoded frame is thrown away
+};
+
+// sws_scale algorithm, from cheapest to sharpest
+enum class scaler_profile
+{
+    fast_bilinear,
+    bilinear,
+    area,
+    bicubic,
+    lanczos,
+};
+
+bool parse_scaler_profile(const std::string& name, scaler_profile& profile);
+const char* scaler_profile_name(scaler_profile profile);
+
+// image codec of snapshots, the name is also the file extension
+enum class snapshot_format
+{
+    pgm,    // luma only
+    png,
+    jpg,
+};
+
+bool parse_snapshot_format(const std::string& name, snapshot_format& format);
+const char* snapshot_format_name(snapshot_format format);
+
+// container of recordings, the name is also the file extension
+enum class record_format
+{
+    mkv,
+    mp4,    // fragmented, so a file cut short stays playable
+    ts,
+};
+
+bool parse_record_format(const std::string& name, record_format& format);
+const char* record_format_name(record_format format);
+
+// tile region of the canvas in pixels, all values are even
+struct tile_rect
+{
+    int m_x = 0;
+    int m_y = 0;
+    int m_width = 0;
+    int m_height = 0;
+};
+
+// explicit placement of one stream in grid cells
+struct tile_span
+{
+    unsigned m_stream = 0;
+    int m_col = 0;
+    int m_row = 0;
+    int m_cols = 1;
+    int m_rows = 1;
+};
+
+// probe limits of urls matching a shell pattern
+struct probe_rule
+{
+    std::string m_pattern;
+    int64_t m_probesize = 0;        // bytes, 0 - libavformat default
+    int64_t m_analyze_ms = 0;       // 0 - libavformat default
+};
+
 struct app_config
 {
     int m_dest_wight = 640;
     int m_dest_height = 480;
-    size_t m_max_frames_in_queue = 1000;
+    size_t m_max_frames_in_queue = 100;
+    queue_full_policy m_queue_full_policy = queue_full_policy::block;
+    int m_output_fps = 25;  // mosaic refresh rate
+    bool m_paced = true;    // false - frames are decoded and composed as fast as possible
+    bool m_loop_input = false;  // restart input from the beginning on end of file
+    std::string m_stats_file;   // periodic dump of stream statistics, .json or text
+    int m_stats_interval = 10;  // seconds
+    bool m_display = true;  // false - no SDL window, mosaic goes only to the output
+    std::string m_output_url;       // empty - no encoded output
+    std::string m_output_format;    // muxer name, empty - guessed from the url
+    std::string m_output_codec = "libx264"; // mpeg4 is used if it is not available
+    int64_t m_output_bitrate = 4000000;
+    size_t m_output_queue = 8;      // composed frames waiting for the encoder
+    std::vector< std::pair<std::string, std::string> > m_output_options;    // passed to the muxer
+    std::string m_snapshot_dir = ".";
+    snapshot_format m_snapshot_format = snapshot_format::jpg;
+    double m_snapshot_rate = 2;     // snapshots per second, requests over it are dropped
+    size_t m_snapshot_queue = 4;    // snapshots waiting for the writer
+    int m_snapshot_interval = 0;    // seconds between thumbnails of every tile and the mosaic, 0 - off
+    std::string m_rec_dir = ".";
+    record_format m_rec_format = record_format::mkv;
+    size_t m_rec_buffer_kb = 8192;  // packets waiting for the disk, more are dropped up to next keyframe
+    int64_t m_rec_segment_mb = 0;   // next file starts on keyframe after this size, 0 - no limit
+    int m_rec_segment_sec = 0;      // or after this duration, 0 - no limit
+    double m_jitter_min_ms = 80;        // presentation delay bounds of a stream
+    double m_jitter_max_ms = 2000;
+    double m_discontinuity_ms = 1000;   // bigger jump back, or forward beyond arrival and jitter_max_ms, restarts timeline
+    int64_t m_late_drop_ms = 500;       // frames later than this are not shown
+    int64_t m_catchup_after_ms = 2000;  // stream dropping late frames this long skips to next keyframe
+    size_t m_decoder_workers = 0; // 0 - number of cores
+    int m_decoder_threads = 0;    // libavcodec threads per stream, 0 - share of m_decode_core_budget
+    int m_decoder_thread_type = 3;  // FF_THREAD_FRAME|FF_THREAD_SLICE
+    int m_decode_core_budget = 0; // cores for all decoders, 0 - number of cores
+    bool m_adaptive_quality = true;
+    double m_quality_min_lead_ms = 300; // less lead over presentation time means stream falls behind
+    int m_tile_border = 0;  // black frame around every tile, pixels
+    scaler_profile m_scaler = scaler_profile::bicubic;
+    scaler_profile m_small_scaler = scaler_profile::fast_bilinear;
+    int m_small_tile_pixels = 0;    // tiles up to this area use m_small_scaler, 0 - off
+    std::vector< std::pair<unsigned, scaler_profile> > m_stream_scalers;  // zero based stream, overrides the above
+    int m_scale_slice_pixels = 1920 * 1080; // bigger sources are scaled in slices, 0 - never
+    int m_scale_threads = 0;        // slices of one frame, 0 - up to 4 by cores
+    size_t m_demux_workers = 0;     // io threads for all streams, 0 - cores plus open slots
+    size_t m_packet_queue_high_kb = 4096;   // demuxer stops reading at this queue size
+    size_t m_packet_queue_low_kb = 1024;    // and resumes when decoding drains it to this one
+    int64_t m_open_timeout_ms = 10000;  // open and probe of an input, 0 - no limit
+    int64_t m_read_timeout_ms = 5000;   // one av_read_frame, timeout counts as read error; 0 - no limit
+    int64_t m_stop_timeout_ms = 1000;   // shutdown reports pool threads still running after that
+    std::vector<probe_rule> m_probe_rules;  // first match wins
+    std::string m_stream_cache = "mstream.streams"; // stream info of known urls, empty - off
+    size_t m_stream_cache_size = 1000;  // urls kept, the least recently used go first
+    int m_grid_cols = 2;
+    int m_grid_rows = 2;
+    std::vector<tile_span> m_spans;
+    // precomputed from grid and spans, index is stream number
+    std::vector<tile_rect> m_tiles;
 };
 
 typedef std::shared_ptr<app_config> app_config_ptr;
 
 const app_config& get_app_config();
 
-enum stream_position
+// apply "set <option> <value>" lines of config file, should be called before threads start
+void load_app_config(const std::string& file_name);
+
+// one "set" option followed by layout rebuild, should be called before threads start
+bool set_app_config(const std::string& name, const std::string& value);
+
+// zero based stream number, index in app_config::m_tiles
+typedef unsigned stream_position;
+
+inline size_t stream_count()
 {
-    stream_pos_tl = 0, stream_pos_tr, stream_pos_bl, stream_pos_br
-};
+    return get_app_config().m_tiles.size();
+}
+
+// io pool threads, app_config::m_demux_workers or a default that doesn't grow with streams
+size_t demux_worker_count();
+
+// profile set for the stream, else by its tile size
+scaler_profile stream_scaler(stream_position pos);
 
-void register_thread(const std::thread::id& id, const std::string& name);
+// name of the calling thread in the log
 void register_current_thread(const std::string& name);
 
 class AutoFree
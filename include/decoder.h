@@ -3,21 +3,56 @@
 #include <string>
 #include <memory>
 #include <common.h>
+#include <recorder.h>
 
 namespace mstream
 {
 
+// thread cpu time of the stream stages, accumulated over all urls of the stream
+struct decoder_stage_times
+{
+    uint64_t m_packets = 0;
+    uint64_t m_frames = 0;      // decoded and scaled
+    int64_t m_demux_us = 0;
+    int64_t m_decode_us = 0;
+    int64_t m_scale_us = 0;
+};
+
 struct i_decoder_context
 {
     virtual ~i_decoder_context() = default;
+    // setters post commands to the stream task, they return right away;
+    // empty url stops the stream
     virtual void set_url(const std::string& url) = 0;
+    // decoder thread count, 0 - automatic share of core budget; applied on next keyframe
+    virtual void set_threads(int threads) = 0;
+    // paused stream keeps its last frame on the tile and reads input only up to the packet queue limit
+    virtual void pause() = 0;
+    virtual void resume() = 0;
+    // from the start of input, live inputs may refuse
+    virtual void seek(double seconds) = 0;
+    // fixed quality_level, < 0 - adaptive
+    virtual void set_quality(int level) = 0;
+    // current adaptive quality, see quality_level
+    virtual int quality_level() const = 0;
+    // remux packets of the stream to app_config::m_rec_dir, a new url starts a new file
+    virtual void record(bool on) = 0;
+    virtual recorder_stats recording_stats() const = 0;
+    virtual decoder_stage_times stage_times() const = 0;
+    // cancels blocking open and read of the stream inputs and finishes the recording,
+    // the stream does nothing afterwards
+    virtual void stop() = 0;
 };
 
 typedef std::shared_ptr<i_decoder_context> i_decoder_context_ptr;
 
 struct i_frame_consumer;
+struct i_worker_pool;
 
-i_decoder_context_ptr start_decoder_thread(std::shared_ptr<i_frame_consumer> consumer, stream_position pos);
+// stream is decoded by tasks on the shared pool, inputs are opened and read on io_pool,
+// it is idle until url is set
+i_decoder_context_ptr start_decoder(std::shared_ptr<i_worker_pool> pool, std::shared_ptr<i_worker_pool> io_pool,
+                                    std::shared_ptr<i_frame_consumer> consumer, stream_position pos);
 
 
 }
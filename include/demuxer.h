@@ -0,0 +1,80 @@
+#pragma once
+
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+#include <common.h>
+
+DECLARE_PTR_S(AVPacket);
+struct AVFormatContext;
+
+namespace mstream
+{
+
+enum class demux_event
+{
+    none,       // queue is empty, wake callback comes with the next item
+    packet,
+    restart,    // input started over, codec buffers have to be flushed
+    end,        // end of input
+    error,      // read failed after retries
+};
+
+// State behind the AVIOInterruptCB of one input: blocking libavformat calls return
+// AVERROR_EXIT once it or its parent is cancelled, or the deadline of the call passes.
+class io_interrupt
+{
+    const std::shared_ptr<io_interrupt> m_parent;
+    std::atomic<int64_t> m_cancel_time;     // av_gettime_relative of the first cancel(), 0 - not cancelled
+    std::atomic<int64_t> m_deadline;        // av_gettime_relative, 0 - none
+public:
+    explicit io_interrupt(std::shared_ptr<io_interrupt> parent = std::shared_ptr<io_interrupt>());
+    io_interrupt(const io_interrupt&) = delete;
+    io_interrupt& operator=(const io_interrupt&) = delete;
+
+    void cancel();
+    bool cancelled() const;
+    // of this or the parent, 0 if running
+    int64_t cancel_time() const;
+    // limits the following blocking calls, 0 - no limit
+    void set_timeout(int64_t timeout_ms);
+    bool expired() const;
+    // installs itself as interrupt callback, must outlive the context
+    void attach(AVFormatContext* fmt);
+};
+
+typedef std::shared_ptr<io_interrupt> io_interrupt_ptr;
+
+struct i_recorder;
+
+// Reads packets of one video stream on the io pool into a byte limited queue
+// ahead of decoding. Reading stops at high water and resumes when the decoder
+// drains the queue to low water, transient read errors are retried.
+struct i_demuxer
+{
+    virtual ~i_demuxer() = default;
+    // called by the decoder only
+    virtual demux_event pop(AVPacketPtr& packet) = 0;
+    virtual bool has_items() const = 0;
+    virtual size_t queued_bytes() const = 0;
+    // position from the start of input, done by the read task: queued packets are dropped
+    // and restart event follows
+    virtual void seek(int64_t position_us) = 0;
+    // packets read from now on are also pushed to the recorder, nullptr - no more
+    virtual void record(std::shared_ptr<i_recorder> recorder) = 0;
+    // cancels current av_read_frame, input is closed with the last reference
+    virtual void stop() = 0;
+};
+
+typedef std::shared_ptr<i_demuxer> i_demuxer_ptr;
+
+struct i_worker_pool;
+
+// takes the opened input over together with the interrupt attached to it, wake is called on the io pool
+// when an item arrives after pop() returned none; cpu_us accumulates thread cpu time of av_read_frame
+i_demuxer_ptr start_demuxer(std::shared_ptr<i_worker_pool> io_pool, AVFormatContext* fmt, io_interrupt_ptr interrupt,
+                            int stream_index, stream_position pos, std::function<void()> wake,
+                            std::shared_ptr< std::atomic<int64_t> > cpu_us);
+
+}
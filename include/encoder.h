@@ -2,7 +2,10 @@
 #define ENCODER_H
 
 #include <memory>
+#include <cstdint>
 #include <common.h>
+#include <output.h>
+#include <snapshot.h>
 
 DECLARE_PTR_S(AVFrame);
 
@@ -10,11 +13,24 @@ namespace mstream
 {
 struct app_config;
 
+struct frame_counters
+{
+    uint64_t m_shown = 0;
+    uint64_t m_late = 0;        // shown later than one output frame after pts
+    uint64_t m_dropped = 0;     // superseded by newer due frame or older than late_drop_ms
+    uint64_t m_catchups = 0;
+    int64_t m_compose_us = 0;   // consumer thread cpu time spent on the stream tile
+};
+
 struct i_frame_consumer
 {
     virtual ~i_frame_consumer() = default;
-    virtual void append_frame(AVFramePtr frame, stream_position pos) = 0;
+    // false if the stream queue is full, call only from the stream decoder task
+    virtual bool append_frame(AVFramePtr frame, stream_position pos) = 0;
     virtual void reset_queue(stream_position pos) = 0;
+    // stream stays behind, decoder should skip to next keyframe; flag is cleared by the call
+    virtual bool catchup_requested(stream_position pos) = 0;
+    virtual frame_counters counters(stream_position pos) const = 0;
     virtual bool done() const = 0;
     
 };
@@ -22,13 +38,21 @@ struct i_frame_consumer
 struct i_frame_consumer_master : public i_frame_consumer
 {
     virtual void set_done() = 0;
+    // set_done and wait for the consumer thread, which exits within one output tick
+    virtual void stop() = 0;
+    // picture of the tile as last composed, written in the background
+    virtual void snapshot(stream_position pos) = 0;
+    // copy of the whole canvas, written in the background
+    virtual void snapshot_mosaic() = 0;
+    virtual snapshot_stats snapshot_counters() const = 0;
 };
 
 
 typedef std::shared_ptr<i_frame_consumer> i_frame_consumer_ptr;
 typedef std::shared_ptr<i_frame_consumer_master> i_frame_consumer_master_ptr;
 
-i_frame_consumer_master_ptr start_consumer_thread();
+// output may be nullptr
+i_frame_consumer_master_ptr start_consumer_thread(i_output_ptr output);
 
 }
 
@@ -4,6 +4,7 @@ extern "C"
 {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavdevice/avdevice.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 #include <libavutil/opt.h>
@@ -18,3 +19,7 @@ extern "C"
 typedef std::shared_ptr<AVFrame> AVFramePtr;
 
 AVFramePtr make_frame_ptr(AVFrame* ptr);
+
+typedef std::shared_ptr<AVPacket> AVPacketPtr;
+
+AVPacketPtr make_packet_ptr(AVPacket* ptr);
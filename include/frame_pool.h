@@ -0,0 +1,34 @@
+#pragma once
+
+#include <memory>
+#include <cstdint>
+#include <common.h>
+
+DECLARE_PTR_S(AVFrame);
+
+namespace mstream
+{
+
+struct frame_pool_stats
+{
+    uint64_t m_hits = 0;        // frames served from the free list
+    uint64_t m_misses = 0;      // frames that had to be allocated
+    size_t m_in_use = 0;        // frames currently handed out
+    size_t m_high_water = 0;    // maximum of m_in_use since creation
+};
+
+// Pool of equally sized frames. A frame returned by get() goes back to the pool
+// when the last AVFramePtr referencing it is released, so in steady state
+// no AVFrame or picture buffer is allocated.
+struct i_frame_pool
+{
+    virtual ~i_frame_pool() = default;
+    virtual AVFramePtr get() = 0;
+    virtual frame_pool_stats stats() const = 0;
+};
+
+typedef std::shared_ptr<i_frame_pool> i_frame_pool_ptr;
+
+i_frame_pool_ptr create_frame_pool(int format, int width, int height);
+
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+
+namespace mstream
+{
+
+// Maps stream media time to presentation time on wall clock, ms.
+// Frames queued in the stream ring are the buffer, this class keeps
+// its depth: delay between frame arrival and presentation follows
+// measured arrival jitter, bounded by jitter_min_ms and jitter_max_ms.
+// Media time going back, running ahead of arrival by more than the buffer
+// can hold, or restart of the input is treated as discontinuity, timeline
+// continues from the last frame then. Gaps forward that arrive in time are
+// kept, frames may be skipped on purpose.
+class jitter_buffer
+{
+    double m_offset = 0;        // presentation time = media time + offset
+    double m_delay = 0;         // current buffer depth
+    double m_jitter = 0;        // RFC 3550 style interarrival jitter estimate
+    double m_prev_transit = 0;
+    double m_last_media = 0;
+    double m_last_present = 0;
+    double m_last_arrival = 0;
+    bool m_started = false;
+    bool m_restart = false;
+    unsigned m_discontinuities = 0;
+public:
+    // media_ms of the frame and its arrival time, returns presentation time
+    double present_time(double media_ms, double arrival_ms, double frame_interval_ms);
+
+    // show frame with media_ms at present_ms, later frames follow it
+    void rebase(double media_ms, double present_ms);
+
+    // input started over, next frame continues the timeline whatever its media time is
+    void restart() {m_restart = true;}
+
+    // media time expected for the next frame when it has no timestamp
+    double next_media(double frame_interval_ms) const;
+
+    double delay() const {return m_delay;}
+    double jitter() const {return m_jitter;}
+    unsigned discontinuities() const {return m_discontinuities;}
+};
+
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace mstream
+{
+
+// Unbounded multi-producer/single-consumer queue for rare messages like
+// stream commands. push() may be called from any thread, pop_all() only from
+// the consumer. Producers link a node with one CAS, the consumer takes the whole
+// list with one exchange, so nobody ever waits for a lock.
+template<typename T>
+class mpsc_queue
+{
+    struct node
+    {
+        T m_item;
+        node* m_next;
+    };
+
+    std::atomic<node*> m_top;   // newest item first
+public:
+    mpsc_queue()
+        : m_top(nullptr)
+    {}
+
+    mpsc_queue(const mpsc_queue&) = delete;
+    mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+    ~mpsc_queue()
+    {
+        free_list(m_top.exchange(nullptr));
+    }
+
+    void push(T item)
+    {
+        node* n = new node{std::move(item), m_top.load(std::memory_order_relaxed)};
+        while (!m_top.compare_exchange_weak(n->m_next, n, std::memory_order_release, std::memory_order_relaxed))
+            ;
+    }
+
+    bool empty() const
+    {
+        return !m_top.load(std::memory_order_acquire);
+    }
+
+    // moves every queued item to the back of the container in push order, the caller handles
+    // them after the nodes are gone; if the container throws, the remaining items are freed
+    template<typename C>
+    void pop_all(C& items)
+    {
+        node* list = m_top.exchange(nullptr, std::memory_order_acquire);
+
+        node* oldest = nullptr;
+        while (list) {
+            node* next = list->m_next;
+            list->m_next = oldest;
+            oldest = list;
+            list = next;
+        }
+
+        try {
+            while (oldest) {
+                items.push_back(std::move(oldest->m_item));
+                node* next = oldest->m_next;
+                delete oldest;
+                oldest = next;
+            }
+        }
+        catch(...) {
+            free_list(oldest);
+            throw;
+        }
+    }
+
+private:
+    static void free_list(node* n)
+    {
+        while (n) {
+            node* next = n->m_next;
+            delete n;
+            n = next;
+        }
+    }
+};
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <memory>
+#include <cstdint>
+#include <string>
+#include <common.h>
+
+DECLARE_PTR_S(AVFrame);
+
+namespace mstream
+{
+
+struct output_stats
+{
+    double m_fps = 0;           // frames encoded per second, last second
+    uint64_t m_encoded = 0;
+    uint64_t m_dropped = 0;     // composed frames not taken because the queue was full
+    uint64_t m_bytes = 0;       // written by the muxer
+    size_t m_queue_depth = 0;
+    size_t m_queue_capacity = 0;
+};
+
+// Encodes composed canvas frames and writes them with libavformat on its own
+// thread. push_frame() never blocks, a frame is dropped if the encoder is behind.
+struct i_output
+{
+    virtual ~i_output() = default;
+    // call only from the consumer thread, frame must not be changed after the call
+    virtual bool push_frame(AVFramePtr frame) = 0;
+    virtual output_stats stats() const = 0;
+    // flush the encoder, write trailer and join the thread
+    virtual void stop() = 0;
+};
+
+typedef std::shared_ptr<i_output> i_output_ptr;
+
+// url, codec, muxer and options are taken from app_config, nullptr if output is not configured
+i_output_ptr start_output_thread();
+
+}
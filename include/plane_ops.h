@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace mstream
+{
+
+// 8 bit plane kernels, widths and heights are in samples of the plane.
+// Fill and copy are memset/memcpy in every variant, only the chroma swizzles are hand vectorized,
+// they serve NV12 decoder frames of tile size and encoders that take only NV12.
+struct plane_kernels
+{
+    const char* m_name;
+    void (*fill)(uint8_t* dst, int linesize, int width, int height, uint8_t value);
+    void (*copy)(uint8_t* dst, int dst_linesize, const uint8_t* src, int src_linesize, int width, int height);
+    // I420 U and V planes to NV12 UV plane, width is in UV pairs
+    void (*interleave_uv)(uint8_t* uv, int uv_linesize, const uint8_t* u, int u_linesize,
+                          const uint8_t* v, int v_linesize, int width, int height);
+    // NV12 UV plane to I420 U and V planes, width is in UV pairs
+    void (*deinterleave_uv)(uint8_t* u, int u_linesize, uint8_t* v, int v_linesize,
+                            const uint8_t* uv, int uv_linesize, int width, int height);
+};
+
+// best variant for this cpu, chosen on first call
+const plane_kernels& plane_ops();
+
+const plane_kernels& scalar_plane_ops();
+
+// every variant this cpu can run, scalar first
+std::vector<const plane_kernels*> supported_plane_ops();
+
+// frame of given thickness inside the rectangle
+void draw_border(uint8_t* dst, int linesize, int x, int y, int width, int height, int thickness, uint8_t value);
+
+// runs every supported variant against scalar on odd sizes and strides, logs mismatches
+bool check_plane_ops();
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace mstream
+{
+
+// decode quality steps, each one is cheaper than the previous
+enum quality_level
+{
+    quality_full = 0,
+    quality_skip_loop_filter,
+    quality_skip_nonref,
+    quality_lowres,
+    quality_skip_nonkey,
+    quality_levels
+};
+
+const char* quality_level_name(int level);
+// false if the name is unknown
+bool parse_quality_level(const std::string& name, int& level);
+
+// Picks decode quality of one stream. Steps down when the stream lead over
+// presentation time is too small and decoding (or the whole box) is busy,
+// steps back up slowly when both have headroom again.
+class quality_controller
+{
+    const bool m_has_lowres;
+    int m_level = quality_full;
+    int m_forced = -1;          // set by user, adaptation is off
+    int64_t m_window_start = 0;
+    int64_t m_last_change = 0;
+    int64_t m_busy_us = 0;      // time spent decoding and scaling in window
+    double m_media_ms = 0;      // media time produced in window
+    double m_min_lead_ms = 0;
+    bool m_has_frames = false;
+public:
+    explicit quality_controller(bool has_lowres)
+        : m_has_lowres(has_lowres)
+    {}
+
+    void add_busy(int64_t us) {m_busy_us += us;}
+    void add_frame(double lead_ms, double media_ms);
+
+    // true if level changed, min_lead_ms - less lead means stream falls behind
+    bool update(int64_t now_us, double min_lead_ms);
+
+    int level() const {return m_level;}
+
+    // fixed level, < 0 - back to adaptation; applied by next update()
+    void force(int level) {m_forced = level;}
+    int forced() const {return m_forced;}
+
+    // starts measuring anew, e.g. after decoding was paused
+    void reset_window(int64_t now_us);
+
+private:
+    int step(int level, int dir) const;
+};
+
+// cpu time of the process over wall time of all cores, 0..1
+double process_cpu_load();
+
+}
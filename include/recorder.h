@@ -0,0 +1,49 @@
+#pragma once
+
+#include <memory>
+#include <cstdint>
+#include <common.h>
+
+DECLARE_PTR_S(AVPacket);
+struct AVCodecParameters;
+struct AVRational;
+
+namespace mstream
+{
+
+struct recorder_stats
+{
+    bool m_recording = false;
+    double m_kbps = 0;          // written to disk, last second
+    uint64_t m_packets = 0;
+    uint64_t m_bytes = 0;
+    uint64_t m_dropped = 0;     // packets not taken because the buffer was full
+    uint64_t m_files = 0;
+    size_t m_queue_packets = 0;
+    size_t m_queue_kb = 0;
+};
+
+// Remuxes demuxed packets of one stream into files without decoding, the muxer
+// runs on its own thread. push_packet() never blocks: packets over
+// app_config::m_rec_buffer_kb are dropped and writing resumes on the next keyframe.
+// A file starts on a keyframe and ends on end(), segment limit, timestamps going back or stop().
+struct i_recorder
+{
+    virtual ~i_recorder() = default;
+    // the following packets have these parameters, the writer thread starts with the first call
+    virtual void begin(const AVCodecParameters* par, const AVRational& time_base) = 0;
+    // takes a reference, packet must not be changed after the call
+    virtual void push_packet(AVPacketPtr packet) = 0;
+    // finishes the file after the packets pushed so far, the following ones are ignored up to begin()
+    virtual void end() = 0;
+    virtual recorder_stats stats() const = 0;
+    // write queued packets, finish the file and join the thread; further calls do nothing
+    virtual void stop() = 0;
+};
+
+typedef std::shared_ptr<i_recorder> i_recorder_ptr;
+
+// directory, container and segmenting are taken from app_config
+i_recorder_ptr create_recorder(stream_position pos);
+
+}
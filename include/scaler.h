@@ -0,0 +1,52 @@
+#pragma once
+
+#include <common.h>
+
+struct SwsContext;
+struct AVFrame;
+
+namespace mstream
+{
+
+// sws_scale of decoded frames into YUV420P tile frames. Context follows source size,
+// format and profile of every frame and is rebuilt only when they change.
+// Sources of app_config::m_scale_slice_pixels and more are scaled in horizontal slices
+// by libswscale threads, where libswscale has them (6.1.100 and later). The first sliced
+// frame after a rebuild is compared with a single threaded scale, slices are turned off
+// for the stream on mismatch.
+class frame_scaler
+{
+    const stream_position m_pos;
+    SwsContext* m_sws = nullptr;
+    int m_width = 0;            // source of m_sws
+    int m_height = 0;
+    int m_format = -1;
+    int m_dst_width = 0;
+    int m_dst_height = 0;
+    scaler_profile m_profile = scaler_profile::bicubic;
+    int m_threads = 1;
+    bool m_verify = false;      // next frame is checked against a single threaded scale
+    bool m_slices_broken = false;
+public:
+    explicit frame_scaler(stream_position pos)
+        : m_pos(pos)
+    {}
+    ~frame_scaler();
+
+    frame_scaler(const frame_scaler&) = delete;
+    frame_scaler& operator=(const frame_scaler&) = delete;
+
+    void scale(const AVFrame* src, AVFrame* dst, scaler_profile profile);
+
+    // slices of the current context, 1 - not sliced
+    int threads() const {return m_threads;}
+
+private:
+    int wanted_threads(const AVFrame* src) const;
+    void rebuild(const AVFrame* src, const AVFrame* dst, scaler_profile profile, int threads);
+    SwsContext* create(int threads) const;
+    void run(SwsContext* sws, int threads, const AVFrame* src, AVFrame* dst) const;
+    bool same_as_single_thread(const AVFrame* src, const AVFrame* dst) const;
+};
+
+}
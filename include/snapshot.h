@@ -0,0 +1,46 @@
+#pragma once
+
+#include <memory>
+#include <cstdint>
+#include <string>
+#include <common.h>
+
+DECLARE_PTR_S(AVFrame);
+
+namespace mstream
+{
+
+struct snapshot_stats
+{
+    uint64_t m_written = 0;
+    uint64_t m_dropped = 0;     // over the rate limit or the queue was full
+    uint64_t m_failed = 0;      // encoding or file errors
+    size_t m_queue_depth = 0;
+    size_t m_queue_capacity = 0;
+};
+
+// Encodes frames to image files with libavcodec on its own thread. write() keeps
+// only a reference to the frame and never blocks, requests over
+// app_config::m_snapshot_rate are refused before they cost anything.
+struct i_snapshot_writer
+{
+    virtual ~i_snapshot_writer() = default;
+    // rate limit and queue allow one more snapshot, call before preparing the frame
+    virtual bool can_write() = 0;
+    // call only from one thread, frame must not be changed after the call
+    virtual bool write(AVFramePtr frame, const std::string& file_name) = 0;
+    virtual snapshot_stats stats() const = 0;
+    // write queued snapshots and join the thread
+    virtual void stop() = 0;
+};
+
+typedef std::shared_ptr<i_snapshot_writer> i_snapshot_writer_ptr;
+
+// format, rate and queue size are taken from app_config
+i_snapshot_writer_ptr start_snapshot_writer();
+
+// file in app_config::m_snapshot_dir with the extension of the format,
+// timestamped names are not overwritten by later snapshots
+std::string snapshot_path(const std::string& name, bool timestamped);
+
+}
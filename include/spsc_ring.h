@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+namespace mstream
+{
+
+// Bounded single-producer/single-consumer ring. push() and discard() may be
+// called only from the producer thread, front()/pop() only from the consumer.
+// size() and full() are safe from any thread, but only approximate.
+template<typename T>
+class spsc_ring
+{
+    std::vector<T> m_items;
+    const size_t m_capacity;
+    char m_pad0[64];
+    std::atomic<size_t> m_head;     // next index to read, owned by consumer
+    char m_pad1[64];
+    std::atomic<size_t> m_tail;     // next index to write, owned by producer
+    std::atomic<size_t> m_discard;  // items before this index are dropped by consumer
+    char m_pad2[64];
+public:
+    explicit spsc_ring(size_t capacity)
+        : m_items(capacity ? capacity : 1)
+        , m_capacity(capacity ? capacity : 1)
+        , m_head(0)
+        , m_tail(0)
+        , m_discard(0)
+    {}
+
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+    // returns false if ring is full, item is left untouched then
+    bool push(const T& item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) >= m_capacity)
+            return false;
+
+        m_items[tail % m_capacity] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // drop everything pushed so far, the consumer releases the items lazily
+    void discard()
+    {
+        m_discard.store(m_tail.load(std::memory_order_relaxed), std::memory_order_release);
+    }
+
+    // nullptr if ring is empty
+    T* front()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t discard = m_discard.load(std::memory_order_acquire);
+        while (head < discard) {
+            m_items[head % m_capacity] = T();
+            m_head.store(++head, std::memory_order_release);
+        }
+
+        if (head == m_tail.load(std::memory_order_acquire))
+            return nullptr;
+
+        return &m_items[head % m_capacity];
+    }
+
+    // must follow front() which returned not nullptr
+    void pop()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        m_items[head % m_capacity] = T();
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    size_t size() const
+    {
+        size_t head = m_head.load(std::memory_order_acquire);
+        return m_tail.load(std::memory_order_acquire) - head;
+    }
+
+    bool full() const
+    {
+        return size() >= m_capacity;
+    }
+
+    size_t capacity() const
+    {
+        return m_capacity;
+    }
+};
+
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <ostream>
+#include <cstdint>
+#include <common.h>
+
+namespace mstream
+{
+
+struct histogram_snapshot
+{
+    uint64_t m_count = 0;
+    uint64_t m_sum = 0;
+    uint64_t m_max = 0;
+    std::vector<uint64_t> m_buckets;
+
+    double mean() const;
+    // values recorded after the earlier snapshot, max stays the overall one
+    histogram_snapshot since(const histogram_snapshot& earlier) const;
+    // p in [0, 1], middle of the bucket holding the value, relative error is below 1/32
+    double percentile(double p) const;
+};
+
+// Log-linear histogram of non negative values: every power of two range is split
+// in 16 buckets. record() is a few relaxed atomic adds and may be called from any thread.
+class histogram
+{
+public:
+    static const int sub_bits = 4;
+    static const int sub_count = 1 << sub_bits;
+    static const int magnitudes = 40;   // values up to 2^40
+    static const int bucket_count = (magnitudes - sub_bits + 1) * sub_count;
+
+    histogram();
+    histogram(const histogram&) = delete;
+    histogram& operator=(const histogram&) = delete;
+
+    void record(int64_t value)
+    {
+        uint64_t v = value > 0 ? (uint64_t)value : 0;
+        if (v >= (1ull << magnitudes))
+            v = (1ull << magnitudes) - 1;
+
+        m_buckets[index(v)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(v, std::memory_order_relaxed);
+
+        uint64_t max = m_max.load(std::memory_order_relaxed);
+        while (v > max && !m_max.compare_exchange_weak(max, v, std::memory_order_relaxed))
+            ;
+    }
+
+    histogram_snapshot snapshot() const;
+
+    static int index(uint64_t v)
+    {
+        if (v < (uint64_t)sub_count)
+            return (int)v;
+        int shift = 63 - __builtin_clzll(v) - sub_bits;
+        return (shift + 1) * sub_count + (int)((v >> shift) & (sub_count - 1));
+    }
+
+    static uint64_t bucket_low(int index);
+    static uint64_t bucket_width(int index);
+
+private:
+    std::atomic<uint64_t> m_buckets[bucket_count];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+};
+
+// latencies are in microseconds
+struct stream_stats
+{
+    // decoder task
+    histogram m_read_us;        // av_read_frame
+    histogram m_packet_queue_kb;    // demuxed packets waiting for the decoder, sampled on every pop
+    histogram m_decode_us;      // avcodec_send_packet call or avcodec_receive_frame call returning a frame
+    histogram m_scale_us;       // sws_scale
+    histogram m_first_frame_ms; // start of open to the first decoded frame
+    histogram m_switch_ms;      // url change to the first frame of the new url queued
+    histogram m_stop_ms;        // input cancel to the input closed
+    // consumer thread
+    histogram m_queue_wait_us;  // from append_frame to composition
+    histogram m_compose_us;
+    histogram m_present_delay_us;   // composition time after frame pts
+    histogram m_queue_depth;    // frames, sampled every consumer tick
+};
+
+struct consumer_stats
+{
+    histogram m_wakeup_late_us; // consumer thread woke up after the deadline it slept to
+    std::atomic<int64_t> m_cpu_us;  // consumer thread cpu time, updated on every wakeup
+
+    consumer_stats() : m_cpu_us(0) {}
+};
+
+// registry is sized by stream_count() on first use, so the layout must be final by then
+stream_stats& get_stream_stats(stream_position pos);
+consumer_stats& get_consumer_stats();
+
+struct i_frame_consumer;
+
+// histograms of all streams plus consumer frame counters
+void write_stats_text(std::ostream& out, const std::shared_ptr<i_frame_consumer>& cons);
+void write_stats_json(std::ostream& out, const std::shared_ptr<i_frame_consumer>& cons);
+
+// rewrites app_config::m_stats_file every m_stats_interval seconds on its own thread,
+// json if the file name ends with .json, text otherwise
+struct i_stats_dump
+{
+    virtual ~i_stats_dump() = default;
+    // join the thread, the file keeps the last dump
+    virtual void stop() = 0;
+};
+
+typedef std::shared_ptr<i_stats_dump> i_stats_dump_ptr;
+
+// nullptr if the dump is off
+i_stats_dump_ptr start_stats_dump(std::shared_ptr<i_frame_consumer> cons);
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <memory>
+#include <common.h>
+
+namespace mstream
+{
+
+// video stream parameters of the last successful open of a url
+struct cached_stream_info
+{
+    int m_stream_index = -1;
+    std::string m_codec;        // avcodec_get_name
+    int m_width = 0;
+    int m_height = 0;
+    std::string m_pix_fmt;      // av_get_pix_fmt_name
+    int m_fps_num = 0;
+    int m_fps_den = 0;
+    std::vector<uint8_t> m_extradata;
+};
+
+// probe limits for the url from app_config::m_probe_rules, zero limits mean libavformat defaults
+probe_rule find_probe_rule(const std::string& url);
+
+// cache lives in app_config::m_stream_cache, it is read on first use
+bool find_cached_stream_info(const std::string& url, cached_stream_info& info);
+
+struct i_worker_pool;
+
+// file is rewritten by a task of the pool, only if the info changed; stores coming
+// before the task runs share one write, urls over app_config::m_stream_cache_size
+// drop the least recently used
+void store_cached_stream_info(std::shared_ptr<i_worker_pool> pool, const std::string& url,
+                              const cached_stream_info& info);
+
+}
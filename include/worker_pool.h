@@ -0,0 +1,30 @@
+#pragma once
+
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <string>
+
+namespace mstream
+{
+
+// Fixed set of threads running short tasks. Every worker has its own task
+// deque, a task posted from a worker goes to its deque, idle workers steal
+// from the others. Deques run oldest first, so tasks reposting themselves
+// take turns with the rest.
+struct i_worker_pool
+{
+    virtual ~i_worker_pool() = default;
+    virtual void post(const std::function<void()>& task) = 0;
+    virtual void post_after(std::chrono::milliseconds delay, const std::function<void()>& task) = 0;
+    virtual size_t size() const = 0;
+    // drop queued tasks and join workers after their current task, call from outside the pool
+    virtual void stop() = 0;
+};
+
+typedef std::shared_ptr<i_worker_pool> i_worker_pool_ptr;
+
+// threads == 0 means number of cores
+i_worker_pool_ptr create_worker_pool(size_t threads, const std::string& name);
+
+}
@@ -0,0 +1,398 @@
+#include "common.h"
+#include "decoder.h"
+#include "encoder.h"
+#include "worker_pool.h"
+#include "plane_ops.h"
+#include "stats.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+using namespace mstream;
+
+// Offline throughput benchmark: inputs are decoded, scaled and composed as fast
+// as possible through the same decoder and consumer code as the player, without
+// display and pacing.
+namespace {
+
+const unsigned scaler_profiles = (unsigned)scaler_profile::lanczos + 1;
+
+struct bench_options
+{
+    std::vector<std::string> m_inputs;
+    std::string m_config;
+    std::string m_json;
+    std::string m_canvas;
+    unsigned m_streams = 0;     // 0 - one per input
+    double m_seconds = 10;
+    double m_warmup = 2;
+    double m_target_fps = 25;
+    bool m_ramp = false;
+    bool m_scalers = false;
+};
+
+void print_usage()
+{
+    std::cout << "Usage: mstream_bench [options] <input>..." << std::endl
+        << "input is a local file or lavfi:<graph>, e.g. lavfi:testsrc2=size=1280x720:rate=25" << std::endl
+        << "  -n <count>      streams, inputs are repeated, default - number of inputs" << std::endl
+        << "  -t <seconds>    measured time of a run, default 10" << std::endl
+        << "  -w <seconds>    warm up before measuring, default 2" << std::endl
+        << "  -f <fps>        realtime target per stream, default 25" << std::endl
+        << "  -c <file>       config with set lines, like mstream.conf" << std::endl
+        << "  -s <WxH>        canvas size" << std::endl
+        << "  -o <file>       write results as json" << std::endl
+        << "  --ramp          add streams one by one up to -n while all of them hold realtime" << std::endl
+        << "  --scalers       run every input once per scaler profile and compare scaling cost" << std::endl;
+}
+
+bool parse_args(int argc, char** argv, bench_options& opt)
+{
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--ramp")
+                opt.m_ramp = true;
+            else if (arg == "--scalers")
+                opt.m_scalers = true;
+            else if (arg == "-n" && has_value)
+                opt.m_streams = std::stoul(argv[++i]);
+            else if (arg == "-t" && has_value)
+                opt.m_seconds = std::stod(argv[++i]);
+            else if (arg == "-w" && has_value)
+                opt.m_warmup = std::stod(argv[++i]);
+            else if (arg == "-f" && has_value)
+                opt.m_target_fps = std::stod(argv[++i]);
+            else if (arg == "-c" && has_value)
+                opt.m_config = argv[++i];
+            else if (arg == "-s" && has_value)
+                opt.m_canvas = argv[++i];
+            else if (arg == "-o" && has_value)
+                opt.m_json = argv[++i];
+            else if (!arg.empty() && arg[0] == '-')
+                return false;
+            else
+                opt.m_inputs.push_back(arg);
+        }
+    }
+    catch(std::exception&) {
+        return false;
+    }
+
+    if (!opt.m_streams)
+        opt.m_streams = opt.m_inputs.size();
+    if (opt.m_scalers) {
+        opt.m_streams = opt.m_inputs.size() * scaler_profiles;
+        opt.m_ramp = false;
+    }
+
+    return !opt.m_inputs.empty() && opt.m_seconds > 0 && opt.m_warmup >= 0 && opt.m_target_fps > 0;
+}
+
+struct stream_sample
+{
+    decoder_stage_times m_decoder;
+    frame_counters m_consumer;
+    histogram_snapshot m_scale_us;
+};
+
+struct stream_result
+{
+    std::string m_input;
+    std::string m_scaler;
+    uint64_t m_frames = 0;      // composed
+    uint64_t m_scaled = 0;      // decoded and scaled
+    double m_fps = 0;
+    double m_demux_ms = 0;      // cpu time of the stage during the run
+    double m_decode_ms = 0;
+    double m_scale_ms = 0;
+    double m_compose_ms = 0;
+    double m_scale_mean_us = 0; // wall time of one frame scaling
+    double m_scale_p99_us = 0;
+};
+
+struct run_result
+{
+    unsigned m_streams = 0;
+    double m_seconds = 0;
+    double m_total_fps = 0;
+    double m_min_fps = 0;
+    double m_consumer_cpu_ms = 0;   // consumer thread, composition and waiting included
+    bool m_realtime = false;
+    std::vector<stream_result> m_per_stream;
+};
+
+std::vector<stream_sample> take_sample(const std::vector<i_decoder_context_ptr>& decoders,
+                                       const i_frame_consumer_ptr& cons, unsigned streams)
+{
+    std::vector<stream_sample> sample(streams);
+    for (unsigned i = 0; i < streams; ++i) {
+        sample[i].m_decoder = decoders[i]->stage_times();
+        sample[i].m_consumer = cons->counters(i);
+        sample[i].m_scale_us = get_stream_stats(i).m_scale_us.snapshot();
+    }
+    return sample;
+}
+
+// streams [0, streams) are running, counters are compared before and after the run
+run_result measure(const std::vector<i_decoder_context_ptr>& decoders, const i_frame_consumer_ptr& cons,
+                   const bench_options& opt, unsigned streams)
+{
+    std::this_thread::sleep_for(std::chrono::duration<double>(opt.m_warmup));
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<stream_sample> before = take_sample(decoders, cons, streams);
+    int64_t consumer_cpu_before = get_consumer_stats().m_cpu_us;
+    std::this_thread::sleep_for(std::chrono::duration<double>(opt.m_seconds));
+    std::vector<stream_sample> after = take_sample(decoders, cons, streams);
+    int64_t consumer_cpu_after = get_consumer_stats().m_cpu_us;
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    run_result run;
+    run.m_streams = streams;
+    run.m_seconds = elapsed.count();
+    run.m_consumer_cpu_ms = (consumer_cpu_after - consumer_cpu_before) / 1000.0;
+    run.m_realtime = true;
+
+    for (unsigned i = 0; i < streams; ++i) {
+        const stream_sample& b = before[i];
+        const stream_sample& a = after[i];
+        stream_result res;
+        res.m_input = opt.m_inputs[i % opt.m_inputs.size()];
+        res.m_scaler = scaler_profile_name(stream_scaler(i));
+        res.m_frames = a.m_consumer.m_shown - b.m_consumer.m_shown;
+        res.m_scaled = a.m_decoder.m_frames - b.m_decoder.m_frames;
+        res.m_fps = res.m_frames / run.m_seconds;
+        res.m_demux_ms = (a.m_decoder.m_demux_us - b.m_decoder.m_demux_us) / 1000.0;
+        res.m_decode_ms = (a.m_decoder.m_decode_us - b.m_decoder.m_decode_us) / 1000.0;
+        res.m_scale_ms = (a.m_decoder.m_scale_us - b.m_decoder.m_scale_us) / 1000.0;
+        res.m_compose_ms = (a.m_consumer.m_compose_us - b.m_consumer.m_compose_us) / 1000.0;
+        histogram_snapshot scale = a.m_scale_us.since(b.m_scale_us);
+        res.m_scale_mean_us = scale.mean();
+        res.m_scale_p99_us = scale.percentile(0.99);
+
+        run.m_total_fps += res.m_fps;
+        run.m_min_fps = i ? std::min(run.m_min_fps, res.m_fps) : res.m_fps;
+        if (res.m_fps < opt.m_target_fps)
+            run.m_realtime = false;
+        run.m_per_stream.push_back(res);
+    }
+
+    return run;
+}
+
+void print_run(const run_result& run)
+{
+    std::cout << "streams " << run.m_streams << " total " << run.m_total_fps << " fps, min "
+        << run.m_min_fps << " fps" << (run.m_realtime ? ", realtime" : "")
+        << ", consumer cpu " << run.m_consumer_cpu_ms / run.m_seconds << " ms/s" << std::endl;
+    for (size_t i = 0; i < run.m_per_stream.size(); ++i) {
+        const stream_result& res = run.m_per_stream[i];
+        double per_frame = res.m_frames ? 1000.0 / res.m_frames : 0;
+        std::cout << "  stream " << i + 1 << " " << res.m_fps << " fps, cpu us/frame"
+            << " demux " << res.m_demux_ms * per_frame
+            << " decode " << res.m_decode_ms * per_frame
+            << " scale " << res.m_scale_ms * per_frame
+            << " compose " << res.m_compose_ms * per_frame
+            << ", scale latency us mean " << (int64_t)res.m_scale_mean_us << " p99 " << (int64_t)res.m_scale_p99_us
+            << " (" << res.m_scaler << ")  " << res.m_input << std::endl;
+    }
+}
+
+// streams of --scalers run input i with profile i / inputs
+void print_scalers(const run_result& run, const bench_options& opt)
+{
+    const app_config& cfg = get_app_config();
+    std::cout << "scaling to " << cfg.m_tiles[0].m_width << "x" << cfg.m_tiles[0].m_height
+        << ", cpu us/frame" << std::endl;
+    for (size_t in = 0; in < opt.m_inputs.size(); ++in) {
+        std::cout << "  " << opt.m_inputs[in] << std::endl;
+        for (size_t i = in; i < run.m_per_stream.size(); i += opt.m_inputs.size()) {
+            const stream_result& res = run.m_per_stream[i];
+            std::cout << "    " << std::setw(14) << std::left << res.m_scaler << std::right
+                << (res.m_scaled ? res.m_scale_ms * 1000 / res.m_scaled : 0) << std::endl;
+        }
+    }
+}
+
+std::string json_string(const std::string& str)
+{
+    std::ostringstream out;
+    out << '"';
+    for (char c : str) {
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if ((unsigned char)c < 0x20)
+            out << "\\u00" << "0123456789abcdef"[(c >> 4) & 0xf] << "0123456789abcdef"[c & 0xf];
+        else
+            out << c;
+    }
+    out << '"';
+    return out.str();
+}
+
+void write_json(std::ostream& out, const bench_options& opt, const std::vector<run_result>& runs,
+                unsigned max_realtime, bool estimated)
+{
+    const app_config& cfg = get_app_config();
+    out << "{" << std::endl
+        << "  \"cores\": " << std::thread::hardware_concurrency() << "," << std::endl
+        << "  \"plane_kernels\": \"" << plane_ops().m_name << "\"," << std::endl
+        << "  \"decoder_workers\": " << cfg.m_decoder_workers << "," << std::endl
+        << "  \"canvas\": \"" << cfg.m_dest_wight << "x" << cfg.m_dest_height << "\"," << std::endl
+        << "  \"grid\": \"" << cfg.m_grid_cols << "x" << cfg.m_grid_rows << "\"," << std::endl
+        << "  \"target_fps\": " << opt.m_target_fps << "," << std::endl
+        << "  \"max_realtime_streams\": " << max_realtime << "," << std::endl
+        << "  \"max_realtime_estimated\": " << (estimated ? "true" : "false") << "," << std::endl
+        << "  \"runs\": [";
+
+    for (size_t r = 0; r < runs.size(); ++r) {
+        const run_result& run = runs[r];
+        out << (r ? "," : "") << std::endl
+            << "    {\"streams\": " << run.m_streams
+            << ", \"seconds\": " << run.m_seconds
+            << ", \"total_fps\": " << run.m_total_fps
+            << ", \"min_fps\": " << run.m_min_fps
+            << ", \"consumer_cpu_ms\": " << run.m_consumer_cpu_ms
+            << ", \"realtime\": " << (run.m_realtime ? "true" : "false")
+            << ", \"per_stream\": [";
+        for (size_t i = 0; i < run.m_per_stream.size(); ++i) {
+            const stream_result& res = run.m_per_stream[i];
+            out << (i ? "," : "") << std::endl
+                << "      {\"input\": " << json_string(res.m_input)
+                << ", \"scaler\": \"" << res.m_scaler << "\""
+                << ", \"frames\": " << res.m_frames
+                << ", \"scaled\": " << res.m_scaled
+                << ", \"fps\": " << res.m_fps
+                << ", \"cpu_ms\": {\"demux\": " << res.m_demux_ms
+                << ", \"decode\": " << res.m_decode_ms
+                << ", \"scale\": " << res.m_scale_ms
+                << ", \"compose\": " << res.m_compose_ms << "}"
+                << ", \"scale_latency_us\": {\"mean\": " << res.m_scale_mean_us
+                << ", \"p99\": " << res.m_scale_p99_us << "}}";
+        }
+        out << "]}";
+    }
+
+    out << std::endl << "  ]" << std::endl << "}" << std::endl;
+}
+
+// square-ish grid with room for all streams
+void set_bench_layout(unsigned streams)
+{
+    int cols = (int)std::ceil(std::sqrt((double)streams));
+    int rows = (int)((streams + cols - 1) / cols);
+    set_app_config("grid", std::to_string(cols) + "x" + std::to_string(rows));
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    bench_options opt;
+    if (!parse_args(argc, argv, opt)) {
+        print_usage();
+        return 1;
+    }
+
+    initialize_log();
+    register_current_thread("main thread");
+    if (!opt.m_config.empty())
+        load_app_config(opt.m_config);
+
+    if (!opt.m_canvas.empty() && !set_app_config("canvas", opt.m_canvas)) {
+        print_usage();
+        return 1;
+    }
+
+    // a wrong kernel would make the numbers meaningless
+    if (!check_plane_ops()) {
+        std::cout << "plane kernels mismatch, see mstream.log" << std::endl;
+        shutdown_log();
+        return 1;
+    }
+    std::cout << "plane kernels " << plane_ops().m_name << std::endl;
+
+    // everything that would hide the decoding cost is off
+    set_app_config("display", "none");
+    set_app_config("pacing", "off");
+    set_app_config("loop_input", "on");
+    set_app_config("queue_full_policy", "block");
+    set_app_config("adaptive_quality", "off");
+    set_bench_layout(opt.m_streams);
+    if (opt.m_scalers) {
+        for (unsigned i = 0; i < opt.m_streams; ++i) {
+            scaler_profile profile = (scaler_profile)(i / opt.m_inputs.size());
+            set_app_config("scaler_stream", std::to_string(i + 1) + " " + scaler_profile_name(profile));
+        }
+    }
+
+    i_frame_consumer_master_ptr cons = start_consumer_thread(i_output_ptr());
+    i_worker_pool_ptr pool = create_worker_pool(get_app_config().m_decoder_workers, "Decoder");
+    i_worker_pool_ptr io_pool = create_worker_pool(demux_worker_count(), "Demux");
+
+    std::vector<i_decoder_context_ptr> decoders(stream_count());
+    for (stream_position pos = 0; pos < decoders.size(); ++pos)
+        decoders[pos] = start_decoder(pool, io_pool, cons, pos);
+
+    std::vector<run_result> runs;
+    unsigned max_realtime = 0;
+    bool estimated = !opt.m_ramp;
+
+    if (opt.m_ramp) {
+        for (unsigned n = 1; n <= opt.m_streams && !cons->done(); ++n) {
+            decoders[n - 1]->set_url(opt.m_inputs[(n - 1) % opt.m_inputs.size()]);
+            runs.push_back(measure(decoders, cons, opt, n));
+            print_run(runs.back());
+            if (!runs.back().m_realtime)
+                break;
+            max_realtime = n;
+        }
+    }
+    else {
+        for (unsigned i = 0; i < opt.m_streams; ++i)
+            decoders[i]->set_url(opt.m_inputs[i % opt.m_inputs.size()]);
+        runs.push_back(measure(decoders, cons, opt, opt.m_streams));
+        print_run(runs.back());
+        if (opt.m_scalers)
+            print_scalers(runs.back(), opt);
+        // assumes streams cost about the same and the box is saturated
+        max_realtime = (unsigned)(runs.back().m_total_fps / opt.m_target_fps);
+    }
+
+    std::cout << "max realtime streams at " << opt.m_target_fps << " fps: " << max_realtime
+        << (estimated ? " (estimated from total throughput)" : "") << std::endl;
+
+    if (!opt.m_json.empty()) {
+        std::ofstream out(opt.m_json);
+        write_json(out, opt, runs, max_realtime, estimated);
+        if (!out)
+            std::cout << "cannot write " << opt.m_json << std::endl;
+    }
+
+    auto stop_start = std::chrono::steady_clock::now();
+    for (auto& dec : decoders)
+        dec->stop();
+    cons->stop();
+    pool->stop();
+    io_pool->stop();
+    decoders.clear();
+    cons.reset();
+    pool.reset();
+    io_pool.reset();
+
+    std::chrono::duration<double, std::milli> stop_time = std::chrono::steady_clock::now() - stop_start;
+    std::cout << "streams stopped in " << (int)stop_time.count() << " ms" << std::endl;
+
+    shutdown_log();
+    return 0;
+}
@@ -5,117 +5,637 @@
 #include <vector>
 #include <thread>
 #include <iostream>
+#include <algorithm>
+#include <time.h>
 
 #include "ffmpeg_afx.h"
 
-extern "C"
+AVFramePtr make_frame_ptr(AVFrame* ptr)
 {
-#include "libavutil/log.h"
+    return AVFramePtr(ptr, [](AVFrame* frame){av_frame_free(&frame);});
+}
 
+AVPacketPtr make_packet_ptr(AVPacket* ptr)
+{
+    return AVPacketPtr(ptr, [](AVPacket* packet){av_packet_free(&packet);});
 }
 
-AVFramePtr make_frame_ptr(AVFrame* ptr)
+namespace mstream
 {
-    return AVFramePtr(ptr, [](AVFrame* frame){av_frame_free(&frame);});
+
+int64_t thread_cpu_us()
+{
+    timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return 0;
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+size_t demux_worker_count()
+{
+    const app_config& cfg = get_app_config();
+    if (cfg.m_demux_workers)
+        return cfg.m_demux_workers;
+
+    // reads take turns and a stuck one ends at read_timeout_ms, opens may block up to
+    // open_timeout_ms, so a few threads more keep background opens from holding up reads;
+    // more than a read and an open per stream is never busy
+    const size_t open_slots = 4;
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    return std::min(2 * stream_count(), cores + open_slots);
+}
+
+std::string file_time_stamp()
+{
+    int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    time_t now = now_ms / 1000;
+    struct tm local;
+    localtime_r(&now, &local);
+    char stamp[32];
+    size_t len = strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &local);
+    snprintf(stamp + len, sizeof(stamp) - len, "_%03d", (int)(now_ms % 1000));
+    return stamp;
+}
+
+namespace {
+
+const char* const g_scaler_names[] = {"fast_bilinear", "bilinear", "area", "bicubic", "lanczos"};
+const char* const g_snapshot_format_names[] = {"pgm", "png", "jpg"};
+const char* const g_record_format_names[] = {"mkv", "mp4", "ts"};
+
+bool parse_size(const std::string& value, int& width, int& height)
+{
+    char sep = 0;
+    std::istringstream f(value);
+    f >> width >> sep >> height;
+    return !f.fail() && sep == 'x' && width > 0 && height > 0;
 }
 
-void av_log_ssream_callback(void *avcl, int level, const char *fmt, va_list vl)
+// cells are rounded down to even size, so a cell narrower than 2 px would be empty
+bool cells_fit(int width, int height, int cols, int rows)
 {
-    int print_prefix = 1;
-    char line[1024];
-    int type[2];
-    unsigned tint = 0;
+    return width / cols >= 2 && height / rows >= 2;
+}
+
+// grid cells are taken by explicit spans first, rest of streams fill free cells row by row
+void build_layout(app_config& cfg)
+{
+    const int cell_w = (cfg.m_dest_wight / cfg.m_grid_cols) & ~1;
+    const int cell_h = (cfg.m_dest_height / cfg.m_grid_rows) & ~1;
+
+    std::vector<bool> busy(cfg.m_grid_cols * cfg.m_grid_rows, false);
+    std::vector<bool> numbered(busy.size(), false);
+    std::vector<tile_span> placed;
+
+    for (const tile_span& span : cfg.m_spans) {
+        if (span.m_col < 0 || span.m_row < 0 || span.m_cols < 1 || span.m_rows < 1 ||
+            span.m_col + span.m_cols > cfg.m_grid_cols || span.m_row + span.m_rows > cfg.m_grid_rows) {
+            LOG_CONS("tile " << span.m_stream + 1 << " is out of grid, ignored");
+            continue;
+        }
+
+        // there are never more tiles than cells
+        if (span.m_stream >= busy.size() || numbered[span.m_stream]) {
+            LOG_CONS("tile " << span.m_stream + 1 << " has wrong stream number, ignored");
+            continue;
+        }
+
+        bool overlap = false;
+        for (int r = span.m_row; r < span.m_row + span.m_rows; ++r)
+            for (int c = span.m_col; c < span.m_col + span.m_cols; ++c)
+                overlap = overlap || busy[r * cfg.m_grid_cols + c];
+
+        if (overlap) {
+            LOG_CONS("tile " << span.m_stream + 1 << " overlaps other tile, ignored");
+            continue;
+        }
+
+        for (int r = span.m_row; r < span.m_row + span.m_rows; ++r)
+            for (int c = span.m_col; c < span.m_col + span.m_cols; ++c)
+                busy[r * cfg.m_grid_cols + c] = true;
 
-    if (level >= 0) {
-        tint = level & 0xff00;
-        level &= 0xff;
+        numbered[span.m_stream] = true;
+        placed.push_back(span);
     }
 
-    if (level > av_log_get_level())
-        return;
+    // stream number has to be below the tile count, which grows when a span gives its cells back
+    size_t tiles;
+    while (true) {
+        tiles = placed.size() + std::count(busy.begin(), busy.end(), false);
+        auto wrong = std::find_if(placed.begin(), placed.end(),
+            [tiles](const tile_span& span){return span.m_stream >= tiles;});
+        if (wrong == placed.end())
+            break;
+
+        LOG_CONS("tile " << wrong->m_stream + 1 << " has wrong stream number, ignored");
+        for (int r = wrong->m_row; r < wrong->m_row + wrong->m_rows; ++r)
+            for (int c = wrong->m_col; c < wrong->m_col + wrong->m_cols; ++c)
+                busy[r * cfg.m_grid_cols + c] = false;
+        placed.erase(wrong);
+    }
 
-    av_log_format_line(avcl, level, fmt, vl, line, sizeof(line), &print_prefix);
-    mstream::trace_log(line);
+    std::vector<tile_span> spans(tiles);
+    std::vector<bool> assigned(spans.size(), false);
+
+    for (const tile_span& span : placed) {
+        spans[span.m_stream] = span;
+        assigned[span.m_stream] = true;
+    }
+
+    size_t cell = 0;
+    for (size_t i = 0; i < spans.size(); ++i) {
+        if (assigned[i])
+            continue;
+
+        while (cell < busy.size() && busy[cell])
+            ++cell;
+        if (cell == busy.size()) {
+            spans.resize(i); // ignored spans left fewer tiles
+            break;
+        }
+
+        busy[cell] = true;
+        spans[i].m_col = cell % cfg.m_grid_cols;
+        spans[i].m_row = cell / cfg.m_grid_cols;
+    }
+
+    cfg.m_tiles.resize(spans.size());
+    for (size_t i = 0; i < spans.size(); ++i) {
+        tile_rect& tile = cfg.m_tiles[i];
+        tile.m_x = spans[i].m_col * cell_w;
+        tile.m_y = spans[i].m_row * cell_h;
+        tile.m_width = spans[i].m_cols * cell_w;
+        tile.m_height = spans[i].m_rows * cell_h;
+    }
 }
 
-namespace mstream
+app_config make_default_config()
 {
+    app_config cfg;
+    build_layout(cfg);
+    return cfg;
+}
+
+app_config g_app_config = make_default_config();
 
-namespace
+bool set_app_config_value(const std::string& name, const std::string& value)
 {
-    std::ofstream m_file_log;
-    std::mutex g_log_mutex;
-    std::mutex g_thred_reg_mx;
+    app_config& cfg = g_app_config;
+    if (name == "canvas") {
+        int width, height;
+        if (!parse_size(value, width, height))
+            return false;
+        if (!cells_fit(width, height, cfg.m_grid_cols, cfg.m_grid_rows))
+            return false;
+        cfg.m_dest_wight = width & ~1;
+        cfg.m_dest_height = height & ~1;
+    }
+    else
+    if (name == "grid") {
+        int cols, rows;
+        if (!parse_size(value, cols, rows) || !cells_fit(cfg.m_dest_wight, cfg.m_dest_height, cols, rows))
+            return false;
+        cfg.m_grid_cols = cols;
+        cfg.m_grid_rows = rows;
+    }
+    else
+    if (name == "tile") {
+        tile_span span;
+        std::istringstream f(value);
+        f >> span.m_stream >> span.m_col >> span.m_row >> span.m_cols >> span.m_rows;
+        if (f.fail() || !span.m_stream)
+            return false;
+        --span.m_stream;
+        cfg.m_spans.push_back(span);
+    }
+    else
+    if (name == "tile_border") {
+        int val = std::stoi(value);
+        if (val < 0)
+            return false;
+        cfg.m_tile_border = val;
+    }
+    else
+    if (name == "probe") {
+        probe_rule rule;
+        std::istringstream f(value);
+        f >> rule.m_pattern >> rule.m_probesize >> rule.m_analyze_ms;
+        if (f.fail() || rule.m_probesize < 0 || rule.m_analyze_ms < 0)
+            return false;
+        cfg.m_probe_rules.push_back(rule);
+    }
+    else
+    if (name == "stream_cache") {
+        cfg.m_stream_cache = value == "off" ? std::string() : value;
+    }
+    else
+    if (name == "stream_cache_size") {
+        size_t val = std::stoul(value);
+        if (!val)
+            return false;
+        cfg.m_stream_cache_size = val;
+    }
+    else
+    if (name == "max_frames_in_queue") {
+        size_t val = std::stoul(value);
+        if (!val)
+            return false;
+        cfg.m_max_frames_in_queue = val;
+    }
+    else
+    if (name == "queue_full_policy") {
+        if (value == "block")
+            cfg.m_queue_full_policy = queue_full_policy::block;
+        else
+        if (value == "drop")
+            cfg.m_queue_full_policy = queue_full_policy::drop;
+        else
+            return false;
+    }
+    else
+    if (name == "scaler") {
+        if (!parse_scaler_profile(value, cfg.m_scaler))
+            return false;
+    }
+    else
+    if (name == "scaler_small") {
+        std::istringstream f(value);
+        std::string size, profile;
+        int width, height;
+        f >> size >> profile;
+        if (!parse_size(size, width, height) || !parse_scaler_profile(profile, cfg.m_small_scaler))
+            return false;
+        cfg.m_small_tile_pixels = width * height;
+    }
+    else
+    if (name == "scaler_stream") {
+        std::istringstream f(value);
+        unsigned stream = 0;
+        std::string profile;
+        scaler_profile sp;
+        f >> stream >> profile;
+        if (f.fail() || !stream || !parse_scaler_profile(profile, sp))
+            return false;
+        cfg.m_stream_scalers.push_back(std::make_pair(stream - 1, sp));
+    }
+    else
+    if (name == "scale_slices") {
+        int width = 0, height = 0;
+        if (value != "off" && !parse_size(value, width, height))
+            return false;
+        cfg.m_scale_slice_pixels = width * height;
+    }
+    else
+    if (name == "scale_threads") {
+        int val = std::stoi(value);
+        if (val < 0)
+            return false;
+        cfg.m_scale_threads = val;
+    }
+    else
+    if (name == "demux_workers") {
+        cfg.m_demux_workers = std::stoul(value);
+    }
+    else
+    if (name == "packet_queue") {
+        std::istringstream f(value);
+        size_t high = 0, low = 0;
+        f >> high >> low;
+        if (f.fail() || !high || low >= high)
+            return false;
+        cfg.m_packet_queue_high_kb = high;
+        cfg.m_packet_queue_low_kb = low;
+    }
+    else
+    if (name == "io_timeout") {
+        std::istringstream f(value);
+        int64_t open_ms = 0, read_ms = 0;
+        f >> open_ms >> read_ms;
+        if (f.fail() || open_ms < 0 || read_ms < 0)
+            return false;
+        cfg.m_open_timeout_ms = open_ms;
+        cfg.m_read_timeout_ms = read_ms;
+    }
+    else
+    if (name == "stop_timeout_ms") {
+        cfg.m_stop_timeout_ms = std::stoll(value);
+        if (cfg.m_stop_timeout_ms < 0)
+            return false;
+    }
+    else
+    if (name == "decoder_workers") {
+        cfg.m_decoder_workers = std::stoul(value);
+    }
+    else
+    if (name == "decoder_threads") {
+        int val = value == "auto" ? 0 : std::stoi(value);
+        if (val < 0)
+            return false;
+        cfg.m_decoder_threads = val;
+    }
+    else
+    if (name == "decoder_thread_type") {
+        if (value == "frame")
+            cfg.m_decoder_thread_type = FF_THREAD_FRAME;
+        else
+        if (value == "slice")
+            cfg.m_decoder_thread_type = FF_THREAD_SLICE;
+        else
+        if (value == "both")
+            cfg.m_decoder_thread_type = FF_THREAD_FRAME|FF_THREAD_SLICE;
+        else
+            return false;
+    }
+    else
+    if (name == "decode_core_budget") {
+        int val = std::stoi(value);
+        if (val < 0)
+            return false;
+        cfg.m_decode_core_budget = val;
+    }
+    else
+    if (name == "adaptive_quality") {
+        if (value != "on" && value != "off")
+            return false;
+        cfg.m_adaptive_quality = value == "on";
+    }
+    else
+    if (name == "quality_min_lead_ms") {
+        cfg.m_quality_min_lead_ms = std::stod(value);
+    }
+    else
+    if (name == "jitter_min_ms") {
+        cfg.m_jitter_min_ms = std::stod(value);
+    }
+    else
+    if (name == "jitter_max_ms") {
+        cfg.m_jitter_max_ms = std::stod(value);
+    }
+    else
+    if (name == "discontinuity_ms") {
+        cfg.m_discontinuity_ms = std::stod(value);
+    }
+    else
+    if (name == "late_drop_ms") {
+        cfg.m_late_drop_ms = std::stoll(value);
+    }
+    else
+    if (name == "catchup_after_ms") {
+        cfg.m_catchup_after_ms = std::stoll(value);
+    }
+    else
+    if (name == "output_fps") {
+        int val = std::stoi(value);
+        if (val <= 0 || val > 1000)
+            return false;
+        cfg.m_output_fps = val;
+    }
+    else
+    if (name == "stats_file") {
+        cfg.m_stats_file = value;
+    }
+    else
+    if (name == "stats_interval") {
+        int val = std::stoi(value);
+        if (val <= 0)
+            return false;
+        cfg.m_stats_interval = val;
+    }
+    else
+    if (name == "log_level") {
+        log_level level;
+        if (!parse_log_level(value, level))
+            return false;
+        set_log_level(level);
+    }
+    else
+    if (name == "pacing") {
+        if (value != "on" && value != "off")
+            return false;
+        cfg.m_paced = value == "on";
+    }
+    else
+    if (name == "loop_input") {
+        if (value != "on" && value != "off")
+            return false;
+        cfg.m_loop_input = value == "on";
+    }
+    else
+    if (name == "display") {
+        if (value != "sdl" && value != "none")
+            return false;
+        cfg.m_display = value == "sdl";
+    }
+    else
+    if (name == "output") {
+        cfg.m_output_url = value;
+    }
+    else
+    if (name == "output_format") {
+        cfg.m_output_format = value;
+    }
+    else
+    if (name == "output_codec") {
+        cfg.m_output_codec = value;
+    }
+    else
+    if (name == "output_bitrate") {
+        int64_t val = std::stoll(value);
+        if (val <= 0)
+            return false;
+        cfg.m_output_bitrate = val * 1000;
+    }
+    else
+    if (name == "output_queue") {
+        size_t val = std::stoul(value);
+        if (!val)
+            return false;
+        cfg.m_output_queue = val;
+    }
+    else
+    if (name == "output_option") {
+        std::istringstream f(value);
+        std::string key, val;
+        f >> key;
+        std::getline(f >> std::ws, val);
+        if (key.empty() || val.empty())
+            return false;
+        cfg.m_output_options.push_back(std::make_pair(key, val));
+    }
+    else
+    if (name == "snapshot_dir") {
+        cfg.m_snapshot_dir = value;
+    }
+    else
+    if (name == "snapshot_format") {
+        if (!parse_snapshot_format(value, cfg.m_snapshot_format))
+            return false;
+    }
+    else
+    if (name == "snapshot_rate") {
+        double val = std::stod(value);
+        if (val <= 0)
+            return false;
+        cfg.m_snapshot_rate = val;
+    }
+    else
+    if (name == "snapshot_queue") {
+        size_t val = std::stoul(value);
+        if (!val)
+            return false;
+        cfg.m_snapshot_queue = val;
+    }
+    else
+    if (name == "snapshot_interval") {
+        int val = std::stoi(value);
+        if (val < 0)
+            return false;
+        cfg.m_snapshot_interval = val;
+    }
+    else
+    if (name == "rec_dir") {
+        cfg.m_rec_dir = value;
+    }
+    else
+    if (name == "rec_format") {
+        if (!parse_record_format(value, cfg.m_rec_format))
+            return false;
+    }
+    else
+    if (name == "rec_buffer_kb") {
+        size_t val = std::stoul(value);
+        if (!val)
+            return false;
+        cfg.m_rec_buffer_kb = val;
+    }
+    else
+    if (name == "rec_segment_mb") {
+        int64_t val = std::stoll(value);
+        if (val < 0)
+            return false;
+        cfg.m_rec_segment_mb = val;
+    }
+    else
+    if (name == "rec_segment_sec") {
+        int val = std::stoi(value);
+        if (val < 0)
+            return false;
+        cfg.m_rec_segment_sec = val;
+    }
+    else
+        return false;
+
+    return true;
+}
+
 }
 
-void initialize_log()
+bool parse_scaler_profile(const std::string& name, scaler_profile& profile)
 {
-    m_file_log.open("mstream.log", std::ofstream::out|std::ofstream::app);
-    av_log_set_callback(av_log_ssream_callback);
+    for (size_t i = 0; i < sizeof(g_scaler_names) / sizeof(g_scaler_names[0]); ++i) {
+        if (name == g_scaler_names[i]) {
+            profile = (scaler_profile)i;
+            return true;
+        }
+    }
+    return false;
 }
 
-namespace {
-// maxinum 10 named threads, for lockfree using
-std::vector< std::pair<std::thread::id, std::string > > m_threads(10);
-    
-std::string thread_name(const std::thread::id& id)
+const char* scaler_profile_name(scaler_profile profile)
+{
+    return g_scaler_names[(int)profile];
+}
+
+bool parse_snapshot_format(const std::string& name, snapshot_format& format)
 {
-    for(size_t i = 0; i < m_threads.size(); ++i) {
-        if (m_threads[i].first == id)
-            return m_threads[i].second;
+    for (size_t i = 0; i < sizeof(g_snapshot_format_names) / sizeof(g_snapshot_format_names[0]); ++i) {
+        if (name == g_snapshot_format_names[i]) {
+            format = (snapshot_format)i;
+            return true;
+        }
     }
-    
-    return "";
+    return false;
 }
 
+const char* snapshot_format_name(snapshot_format format)
+{
+    return g_snapshot_format_names[(int)format];
 }
 
-void register_thread(const std::thread::id& id, const std::string& name)
+bool parse_record_format(const std::string& name, record_format& format)
 {
-    std::unique_lock<std::mutex> lock(g_thred_reg_mx);
-    
-    for(size_t i = 0; i < m_threads.size(); ++i) {
-        if (m_threads[i].first == std::thread::id()) {
-            m_threads[i].first = id;
-            m_threads[i].second = name;
-            break;
+    for (size_t i = 0; i < sizeof(g_record_format_names) / sizeof(g_record_format_names[0]); ++i) {
+        if (name == g_record_format_names[i]) {
+            format = (record_format)i;
+            return true;
         }
     }
-        
+    return false;
 }
 
-void register_current_thread(const std::string& name)
+const char* record_format_name(record_format format)
 {
-    auto id = std::this_thread::get_id();
-    register_thread(id, name);
+    return g_record_format_names[(int)format];
 }
 
-void trace_log(const std::string& str, bool copy_to_console)
+scaler_profile stream_scaler(stream_position pos)
 {
-    double currtime = (av_gettime() / 1000.0);
-    std::unique_lock<std::mutex> lock(g_log_mutex);
-    std::string tname = thread_name(std::this_thread::get_id());
-    
-    auto dump = [&](std::ostream& strm) {
-        strm << (int64_t)currtime << " thrd:";
-        if (tname.empty())
-            strm << std::this_thread::get_id();
-        else
-            strm << tname;
-        
-        strm << " " << str << std::endl;
-    };
-    
-    dump(m_file_log);
-    
-    if (copy_to_console)
-        dump(std::cout);
+    const app_config& cfg = get_app_config();
+    // last line of the config wins
+    for (auto it = cfg.m_stream_scalers.rbegin(); it != cfg.m_stream_scalers.rend(); ++it) {
+        if (it->first == pos)
+            return it->second;
+    }
+
+    const tile_rect& tile = cfg.m_tiles[pos];
+    if (tile.m_width * tile.m_height <= cfg.m_small_tile_pixels)
+        return cfg.m_small_scaler;
+    return cfg.m_scaler;
 }
 
 const app_config& get_app_config()
 {
-    static app_config cfg;
-    return cfg;
+    return g_app_config;
+}
+
+bool set_app_config(const std::string& name, const std::string& value)
+{
+    bool ok = false;
+    try {
+        ok = set_app_config_value(name, value);
+    } catch(...) {}
+
+    build_layout(g_app_config);
+    return ok;
+}
+
+void load_app_config(const std::string& file_name)
+{
+    std::ifstream infile(file_name);
+    std::string line;
+    while (std::getline(infile, line))
+    {
+        std::istringstream f(line);
+        std::string cmd, name, value;
+        f >> cmd >> name >> std::ws;
+        std::getline(f, value);
+        value.erase(value.find_last_not_of(" \t\r") + 1);
+        if (cmd != "set")
+            continue;
+
+        bool ok = false;
+        try {
+            ok = set_app_config_value(name, value);
+        } catch(...) {}
+
+        if (!ok)
+            LOG_CONS("wrong config option: " << line);
+    }
+
+    build_layout(g_app_config);
+    LOG("layout " << g_app_config.m_grid_cols << "x" << g_app_config.m_grid_rows
+        << " streams " << g_app_config.m_tiles.size());
 }
 
 }
@@ -2,39 +2,187 @@
 #include <stdexcept>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <map>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
 
 #include "ffmpeg_afx.h"
 #include "common.h"
 
 #include "encoder.h"
+#include "frame_pool.h"
+#include "worker_pool.h"
+#include "quality_controller.h"
+#include "jitter_buffer.h"
+#include "stats.h"
+#include "plane_ops.h"
+#include "stream_info.h"
+#include "scaler.h"
+#include "demuxer.h"
+#include "mpsc_queue.h"
+#include "recorder.h"
 
 namespace mstream
 {
 
+enum class decode_status
+{
+    ready,      // next step can run right away
+    queue_full, // frame is waiting for room in the stream queue
+    ahead,      // stream is far ahead of presentation time
+    starved,    // packet queue is empty, demuxer wakes the stream up
+};
+
+struct stage_counters
+{
+    std::atomic<uint64_t> m_packets;
+    std::atomic<uint64_t> m_frames;
+    std::atomic<int64_t> m_demux_us;
+    std::atomic<int64_t> m_decode_us;
+    std::atomic<int64_t> m_scale_us;
+
+    stage_counters()
+        : m_packets(0)
+        , m_frames(0)
+        , m_demux_us(0)
+        , m_decode_us(0)
+        , m_scale_us(0)
+    {}
+};
+
+// libavcodec threads of all decoders come from one core budget. Streams with fixed
+// thread count take theirs first, automatic streams share the rest by weight.
+class thread_budget
+{
+    struct entry
+    {
+        double m_weight;
+        int m_fixed;    // 0 - automatic
+    };
+    
+    std::mutex m_mx;
+    std::map<const void*, entry> m_entries;
+    std::atomic<unsigned> m_generation;
+    
+    thread_budget()
+        : m_generation(0)
+    {}
+public:
+    static thread_budget& instance()
+    {
+        static thread_budget budget;
+        return budget;
+    }
+    
+    void set(const void* owner, double weight, int fixed)
+    {
+        std::unique_lock<std::mutex> lock(m_mx);
+        entry& e = m_entries[owner];
+        e.m_weight = weight;
+        e.m_fixed = fixed;
+        ++m_generation;
+    }
+    
+    void remove(const void* owner)
+    {
+        std::unique_lock<std::mutex> lock(m_mx);
+        if (m_entries.erase(owner))
+            ++m_generation;
+    }
+    
+    int share(const void* owner)
+    {
+        int budget = get_app_config().m_decode_core_budget;
+        if (!budget)
+            budget = std::max(1u, std::thread::hardware_concurrency());
+        
+        std::unique_lock<std::mutex> lock(m_mx);
+        double total = 0;
+        for (auto& e : m_entries) {
+            if (e.second.m_fixed)
+                budget -= e.second.m_fixed;
+            else
+                total += e.second.m_weight;
+        }
+        
+        auto it = m_entries.find(owner);
+        if (it == m_entries.end() || total <= 0)
+            return 1;
+        
+        int threads = (int)std::lround(std::max(budget, 0) * it->second.m_weight / total);
+        return std::min(std::max(threads, 1), 16);
+    }
+    
+    // changes on any set/remove, decoders compare it to know when to rebalance
+    unsigned generation() const
+    {
+        return m_generation;
+    }
+};
+
 class decoder
 {
     AVFormatContext *m_fmt;
     AVCodecContext* m_dec_ctx;
     int m_stream_index;
-    unsigned m_frame_num = 0;
     const i_frame_consumer_ptr m_consumer;
-    SwsContext * m_sws = nullptr;
+    frame_scaler m_scaler;
     AVFramePtr m_frame;
     const stream_position m_pos;
-    AVRational m_tb;
+    AVRational m_tb;            // of the video stream
+    AVRational m_framerate;
+    AVCodecParameters* m_par = nullptr; // copy, the input belongs to the demuxer after init
+    io_interrupt_ptr m_interrupt;   // of the input, shared with the demuxer
+    i_worker_pool_ptr m_io_pool;    // writes the stream info cache
+    i_demuxer_ptr m_demuxer;
+    i_recorder_ptr m_recorder;  // gets packets of m_demuxer
+    cached_stream_info m_info;  // what goes to the stream info cache after the first frame
+    const i_frame_pool_ptr m_pool;
+    const AVCodec* m_codec = nullptr;
+    double m_weight = 0;
+    int m_thread_setting;       // 0 - automatic, < 0 - from app config
+    int m_threads = 0;          // requested for current codec context
+    unsigned m_budget_generation = 0;
+    std::unique_ptr<quality_controller> m_quality;
+    int m_lowres = 0;           // lowres of current codec context
+    jitter_buffer m_clock;
+    bool m_catchup = false;     // skipping packets up to next keyframe
+    bool m_rebase = false;      // move timeline to now if first frame after catch up is still late
+    const std::shared_ptr<stage_counters> m_stages;
+    stream_stats& m_stats;
+    bool m_active = false;      // owns the tile, frames go to the consumer
+    std::string m_url;
+    int64_t m_open_start = 0;   // av_gettime_relative, reset after the first frame
+    const char* m_probe = "";   // how the input was probed, for the first frame log
 public:
-    decoder(i_frame_consumer_ptr consumer, stream_position pos) 
+    decoder(i_frame_consumer_ptr consumer, stream_position pos, std::shared_ptr<stage_counters> stages)
         : m_fmt(nullptr)
         , m_dec_ctx(nullptr)
         , m_stream_index(-1)
         , m_consumer(MANDATORY_PTR(consumer))
+        , m_scaler(pos)
         , m_pos(pos)
+        , m_pool(create_frame_pool(AV_PIX_FMT_YUV420P,
+                                   get_app_config().m_tiles[pos].m_width,
+                                   get_app_config().m_tiles[pos].m_height))
+        , m_thread_setting(-1)
+        , m_stages(MANDATORY_PTR(stages))
+        , m_stats(get_stream_stats(pos))
     {
     }
     
     ~decoder()
     {
-        if (!m_consumer->done()) {
+        // blocked open or read returns right away, input is closed by the demuxer when its read task ends
+        if (m_interrupt)
+            m_interrupt->cancel();
+        record(i_recorder_ptr());
+        
+        if (m_active && !m_consumer->done()) {
+            // discarded frames go back to the pool through their deleter when the consumer drops them,
+            // black frame is not retried if the queue is still full
             m_consumer->reset_queue(m_pos);
             send_frame(true);
         }
@@ -43,259 +191,1031 @@ public:
             avformat_close_input(&m_fmt);
         if (m_dec_ctx)
             avcodec_free_context(&m_dec_ctx);
-        if (m_sws)
-            sws_freeContext(m_sws);
+        avcodec_parameters_free(&m_par);
+        
+        thread_budget::instance().remove(this);
+
+        frame_pool_stats st = m_pool->stats();
+        LOG("frame pool stream " << (int)m_pos << " hits " << st.m_hits << " misses " << st.m_misses
+            << " high water " << st.m_high_water);
     }
     
-    void init(std::string filename)
+    // wake is called from the io pool when packets arrive after decode_frame() returned starved,
+    // cancel of the interrupt stops opening and reading of the input
+    void init(std::string filename, int thread_setting, i_worker_pool_ptr io_pool, io_interrupt_ptr interrupt,
+              std::function<void()> wake)
     {
-        int ret;
-        if ((ret = avformat_open_input(&m_fmt, filename.c_str(), NULL, NULL)) < 0)
-            THROW_ERR("Cannot open input file " << filename);
+        m_interrupt = MANDATORY_PTR(interrupt);
+        m_io_pool = io_pool;
+        m_thread_setting = thread_setting;
+        m_url = filename;
+        m_open_start = av_gettime_relative();
+
+        // known url is probed briefly, what the probe misses comes from the cache
+        cached_stream_info cached;
+        bool short_probe = find_cached_stream_info(filename, cached);
+        open_input(filename, short_probe);
+        m_probe = short_probe ? "cached" : "full";
         
-        if ((ret = avformat_find_stream_info(m_fmt, NULL)) < 0)
-            THROW_ERR("Cannot find stream information");
+        if (short_probe && !apply_cached_info(cached)) {
+            LOG("stream " << m_pos << " cached info of " << filename << " doesn't match, full probe");
+            avformat_close_input(&m_fmt);
+            m_codec = nullptr;
+            open_input(filename, false);
+            m_probe = "full after cache mismatch";
+        }
+        
+        if (!short_probe || !m_codec) {
+            // decoder is looked up apart, the out parameter of av_find_best_stream became const in ffmpeg 5
+            m_stream_index = av_find_best_stream(m_fmt, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+            if (m_stream_index < 0)
+                THROW_ERR("Cannot find a video stream in the input file");
+            m_codec = avcodec_find_decoder(m_fmt->streams[m_stream_index]->codecpar->codec_id);
+            if (!m_codec)
+                THROW_ERR("Cannot find a decoder for " << avcodec_get_name(m_fmt->streams[m_stream_index]->codecpar->codec_id));
+        }
         
-        AVCodec *dec;
-        m_stream_index = av_find_best_stream(m_fmt, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0);
-        if (m_stream_index < 0)
-            THROW_ERR("Cannot find a video stream in the input file");
+        LOG("stream " << m_pos << " opened " << filename << " in "
+            << (av_gettime_relative() - m_open_start) / 1000 << " ms, probe " << m_probe);
 
-        m_dec_ctx = avcodec_alloc_context3(dec);
-        if (!m_dec_ctx)
+        AVStream *stream = m_fmt->streams[m_stream_index];
+        m_tb = stream->time_base;
+        m_framerate = av_guess_frame_rate(m_fmt, stream, NULL);
+        m_par = avcodec_parameters_alloc();
+        if (!m_par || avcodec_parameters_copy(m_par, stream->codecpar) < 0)
             THROW_ERR("Out of memory");
+        keep_stream_info();
         
-        AVStream *stream = m_fmt->streams[m_stream_index];
-        avcodec_parameters_to_context(m_dec_ctx, stream->codecpar);
+        // decode cost is mostly proportional to pixel rate, entropy decoding to bitrate
+        AVRational fps = m_framerate;
+        int64_t bit_rate = m_par->bit_rate ? m_par->bit_rate : m_fmt->bit_rate;
+        m_weight = m_par->width * m_par->height * (fps.den ? av_q2d(fps) : 25) / 1e6
+                 + bit_rate / 1e6;
+        if (m_weight <= 0)
+            m_weight = 1;
+        
+        update_budget();
+        m_budget_generation = thread_budget::instance().generation();
+        m_quality.reset(new quality_controller(m_codec->max_lowres > 0));
+        open_codec(wanted_threads());
+        
+        m_frame = make_frame_ptr(av_frame_alloc());
+        
+        // aliasing pointer keeps the counters alive as long as the read task runs
+        std::shared_ptr< std::atomic<int64_t> > demux_us(m_stages, &m_stages->m_demux_us);
+        m_demuxer = start_demuxer(io_pool, m_fmt, m_interrupt, m_stream_index, m_pos, wake, demux_us);
+        m_fmt = nullptr;
+    }
+    
+    bool has_input() const
+    {
+        return m_demuxer && m_demuxer->has_items();
+    }
+    
+    void open_input(const std::string& filename, bool short_probe)
+    {
+        // "lavfi:<filtergraph>" is a synthetic source, e.g. lavfi:testsrc2=size=1280x720:rate=25
+        const AVInputFormat* input_format = NULL;
+        std::string input = filename;
+        if (input.compare(0, 6, "lavfi:") == 0) {
+            static std::once_flag devices_registered;
+            std::call_once(devices_registered, [](){avdevice_register_all();});
+            input_format = av_find_input_format("lavfi");
+            if (!input_format)
+                THROW_ERR("lavfi input is not available");
+            input = input.substr(6);
+        }
+        
+        // cached parameters only need the demuxer to find the stream
+        const int64_t short_probesize = 64 * 1024;
+        const int64_t short_analyze_ms = 100;
+        probe_rule rule = find_probe_rule(filename);
+        if (short_probe) {
+            rule.m_probesize = rule.m_probesize ? std::min(rule.m_probesize, short_probesize) : short_probesize;
+            rule.m_analyze_ms = rule.m_analyze_ms ? std::min(rule.m_analyze_ms, short_analyze_ms) : short_analyze_ms;
+        }
+        
+        AVDictionary* opts = nullptr;
+        AutoFree free_opts([&opts](){av_dict_free(&opts);});
+        if (rule.m_probesize)
+            av_dict_set_int(&opts, "probesize", std::max(rule.m_probesize, (int64_t)32), 0);
+        if (rule.m_analyze_ms)
+            av_dict_set_int(&opts, "analyzeduration", rule.m_analyze_ms * 1000, 0);
+        
+        m_fmt = avformat_alloc_context();
+        if (!m_fmt)
+            THROW_ERR("Out of memory");
+        m_interrupt->attach(m_fmt);
         
-        m_dec_ctx->framerate = av_guess_frame_rate(m_fmt, stream, NULL);
+        // one deadline for open and probe, a dead server can stall either
+        m_interrupt->set_timeout(get_app_config().m_open_timeout_ms);
+        AutoFree clear_timeout([this](){m_interrupt->set_timeout(0);});
         
-        if ((ret = avcodec_open2(m_dec_ctx, dec, NULL)) < 0)
+        // context is freed on failure, the format is taken as non-const before ffmpeg 5
+        if (avformat_open_input(&m_fmt, input.c_str(), const_cast<AVInputFormat*>(input_format), &opts) < 0)
+            THROW_ERR("Cannot open input file " << filename << interrupt_reason());
+        
+        if (avformat_find_stream_info(m_fmt, NULL) < 0)
+            THROW_ERR("Cannot find stream information of " << filename << interrupt_reason());
+    }
+    
+    const char* interrupt_reason() const
+    {
+        if (m_interrupt->cancelled())
+            return ", cancelled";
+        if (m_interrupt->expired())
+            return ", timeout";
+        return "";
+    }
+    
+    // short probe must find the same stream, parameters it left unknown are taken from the cache
+    bool apply_cached_info(const cached_stream_info& cached)
+    {
+        if (cached.m_stream_index < 0 || cached.m_stream_index >= (int)m_fmt->nb_streams)
+            return false;
+        
+        AVStream* stream = m_fmt->streams[cached.m_stream_index];
+        AVCodecParameters* par = stream->codecpar;
+        if (par->codec_type != AVMEDIA_TYPE_VIDEO || cached.m_codec != avcodec_get_name(par->codec_id))
+            return false;
+        if (par->width && (par->width != cached.m_width || par->height != cached.m_height))
+            return false;
+        
+        m_codec = avcodec_find_decoder(par->codec_id);
+        if (!m_codec)
+            return false;
+        
+        if (!par->width) {
+            par->width = cached.m_width;
+            par->height = cached.m_height;
+        }
+        if (par->format < 0)
+            par->format = av_get_pix_fmt(cached.m_pix_fmt.c_str());
+        if (!par->extradata_size && !cached.m_extradata.empty()) {
+            par->extradata = (uint8_t*)av_mallocz(cached.m_extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+            if (!par->extradata)
+                return false;
+            memcpy(par->extradata, cached.m_extradata.data(), cached.m_extradata.size());
+            par->extradata_size = (int)cached.m_extradata.size();
+        }
+        if (!stream->avg_frame_rate.num && !stream->r_frame_rate.num && cached.m_fps_den)
+            stream->avg_frame_rate = AVRational{cached.m_fps_num, cached.m_fps_den};
+        
+        m_stream_index = cached.m_stream_index;
+        return true;
+    }
+    
+    void keep_stream_info()
+    {
+        m_info.m_stream_index = m_stream_index;
+        m_info.m_codec = avcodec_get_name(m_par->codec_id);
+        m_info.m_width = m_par->width;
+        m_info.m_height = m_par->height;
+        m_info.m_fps_num = m_framerate.num;
+        m_info.m_fps_den = m_framerate.den;
+        m_info.m_extradata.assign(m_par->extradata, m_par->extradata + m_par->extradata_size);
+    }
+    
+    // what the first frame proved to work is kept for the next open
+    void first_frame_decoded()
+    {
+        int64_t first_frame_ms = (av_gettime_relative() - m_open_start) / 1000;
+        m_open_start = 0;
+        m_stats.m_first_frame_ms.record(first_frame_ms);
+        LOG("stream " << m_pos << " first frame of " << m_url << " in " << first_frame_ms
+            << " ms, probe " << m_probe);
+        
+        const char* pix_fmt = av_get_pix_fmt_name(m_dec_ctx->pix_fmt);
+        m_info.m_pix_fmt = pix_fmt ? pix_fmt : "none";
+        store_cached_stream_info(m_io_pool, m_url, m_info);
+    }
+    
+    // inactive decoder holds its first frame in m_pending
+    bool primed() const
+    {
+        return !m_active && m_pending;
+    }
+    
+    // takes over the tile, the held first frame goes out
+    void activate()
+    {
+        m_active = true;
+        flush_pending();
+    }
+    
+    // tile goes to the next decoder, nothing is sent on destruction
+    void release_tile()
+    {
+        m_active = false;
+    }
+    
+    // (re)create codec context, frames inside the old one are lost
+    void open_codec(int threads)
+    {
+        AVCodecContext* ctx = avcodec_alloc_context3(m_codec);
+        if (!ctx)
+            THROW_ERR("Out of memory");
+        AutoFree free_ctx([&ctx](){avcodec_free_context(&ctx);});
+        
+        avcodec_parameters_to_context(ctx, m_par);
+        
+        ctx->framerate = m_framerate;
+        ctx->thread_count = threads;
+        ctx->thread_type = get_app_config().m_decoder_thread_type;
+        ctx->lowres = wanted_lowres();
+        apply_quality(ctx);
+        
+        if (avcodec_open2(ctx, m_codec, NULL) < 0)
             THROW_ERR("Cannot open video decoder");
         
-        m_frame = make_frame_ptr(av_frame_alloc());
+        free_ctx.cancel();
+        if (m_dec_ctx)
+            avcodec_free_context(&m_dec_ctx);
+        m_dec_ctx = ctx;
+        m_threads = threads;
+        m_lowres = ctx->lowres;
+        m_receiving = false;
         
-        m_sws = sws_alloc_context();
-
-        av_opt_set_int(m_sws, "srcw", m_dec_ctx->width, 0);
-        av_opt_set_int(m_sws, "srch", m_dec_ctx->height, 0);
-        av_opt_set_int(m_sws, "src_format", m_dec_ctx->pix_fmt, 0);
-        av_opt_set_int(m_sws, "dstw", get_app_config().m_dest_wight/2, 0);
-        av_opt_set_int(m_sws, "dsth", get_app_config().m_dest_height/2, 0);
-        av_opt_set_int(m_sws, "dst_format", AV_PIX_FMT_YUV420P, 0);
-        av_opt_set_int(m_sws, "sws_flags", SWS_BICUBIC, 0);
+        LOG("stream " << m_pos << " decoder threads " << threads << " active type " << ctx->active_thread_type
+            << " lowres " << m_lowres);
+    }
+    
+    int wanted_lowres() const
+    {
+        return m_quality->level() >= quality_lowres ? std::min(1, (int)m_codec->max_lowres) : 0;
+    }
+    
+    // skip settings are read by codec on every frame, lowres needs reopen
+    void apply_quality(AVCodecContext* ctx) const
+    {
+        int level = m_quality->level();
+        ctx->skip_loop_filter = level >= quality_skip_loop_filter ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+        ctx->skip_frame = level >= quality_skip_nonkey ? AVDISCARD_NONKEY
+                        : level >= quality_skip_nonref ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+    }
+    
+    int quality_level() const
+    {
+        return m_quality ? m_quality->level() : quality_full;
+    }
+    
+    int thread_setting() const
+    {
+        return m_thread_setting >= 0 ? m_thread_setting : get_app_config().m_decoder_threads;
+    }
+    
+    int wanted_threads()
+    {
+        int setting = thread_setting();
+        return setting > 0 ? setting : thread_budget::instance().share(this);
+    }
+    
+    // bumps budget generation, so every decoder rechecks its share on next keyframe
+    void update_budget()
+    {
+        thread_budget::instance().set(this, m_weight, thread_setting());
+    }
+    
+    void set_thread_setting(int setting)
+    {
+        if (setting == m_thread_setting)
+            return;
+        m_thread_setting = setting;
+        update_budget();
+    }
+    
+    // level < 0 - adaptive, lowres change waits for a keyframe like thread changes
+    void set_forced_quality(int level)
+    {
+        if (!m_quality || level == m_quality->forced())
+            return;
+        m_quality->force(level);
+        if (m_dec_ctx && m_quality->update(av_gettime_relative(), 0))
+            apply_quality(m_dec_ctx);
+    }
+    
+    // decoding continues from the keyframe before position, frames of the old position are dropped
+    void seek(int64_t position_us)
+    {
+        m_seeking = true;
+        m_demuxer->seek(position_us);
+    }
+    
+    // the file of the recorder starts with the next keyframe read, nullptr finishes it
+    void record(i_recorder_ptr recorder)
+    {
+        if (recorder == m_recorder || !m_demuxer)
+            return;
+        
+        if (m_recorder) {
+            m_demuxer->record(i_recorder_ptr());
+            m_recorder->end();
+        }
+        m_recorder = recorder;
+        if (m_recorder) {
+            m_recorder->begin(m_par, m_tb);
+            m_demuxer->record(m_recorder);
+        }
+    }
+    
+    // timeline went on while decoding was paused, next frame is shown right away
+    void resume()
+    {
+        m_rebase = true;
+        if (m_quality)
+            m_quality->reset_window(av_gettime_relative());
+    }
+    
+    // new thread count and lowres are applied on keyframe, so reopened codec starts clean
+    void reopen_codec_if_needed(const AVPacket& packet)
+    {
+        if (!(packet.flags & AV_PKT_FLAG_KEY))
+            return;
+        
+        int threads = m_threads;
+        unsigned generation = thread_budget::instance().generation();
+        if (generation != m_budget_generation) {
+            m_budget_generation = generation;
+            threads = wanted_threads();
+        }
         
-        if (sws_init_context(m_sws, NULL, NULL) < 0)
-            THROW_ERR("Cannot init scale context");
+        if (threads != m_threads || wanted_lowres() != m_lowres) {
+            drain_codec();
+            open_codec(threads);
+        }
+    }
+    
+    // frames held by frame threads and reordering go out before the context is replaced,
+    // the queue takes one waiting frame, the rest are dropped
+    void drain_codec()
+    {
+        if (avcodec_send_packet(m_dec_ctx, nullptr) < 0)
+            return;
+        
+        int dropped = 0;
+        while (avcodec_receive_frame(m_dec_ctx, m_frame.get()) >= 0) {
+            if (!flush_pending()) {
+                ++dropped;
+                continue;
+            }
+            if (m_open_start)
+                first_frame_decoded();
+            send_frame();
+        }
+        
+        if (dropped)
+            LOG("stream " << m_pos << " codec reopen dropped " << dropped << " frames, queue is full");
     }
     
     double m_last_pts = 0;
-    double m_decode_begin = 0;
+    AVFramePtr m_pending;       // frame waiting for room in the queue
+    bool m_receiving = false;   // codec may still have frames of the last packet
+    bool m_seeking = false;     // seek requested, demuxer restart ends it
     
-    void decode_frame()
+    // one step of decoding, never blocks on the consumer
+    decode_status decode_frame()
     {
-        AVPacket packet = {};
-        AutoFree free_packet([&packet](){av_packet_unref(&packet);});
+        if (!flush_pending())
+            return decode_status::queue_full;
+        
+        if (m_receiving) {
+            receive_frames();
+            return decode_status::ready;
+        }
         
         double currtime = (av_gettime() / 1000.0);
 
-        if (m_last_pts - currtime > 2000) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            return;
-        }
+        if (get_app_config().m_paced && m_last_pts - currtime > get_app_config().m_jitter_max_ms)
+            return decode_status::ahead;
 
-        int ret;
-        if ((ret = av_read_frame(m_fmt, &packet)) < 0)
+        AVPacketPtr packet_ptr;
+        switch (m_demuxer->pop(packet_ptr)) {
+        case demux_event::none:
+            return decode_status::starved;
+        case demux_event::restart:
+            // frames still buffered in the codec are dropped, timeline goes on from the last frame
+            avcodec_flush_buffers(m_dec_ctx);
+            m_clock.restart();
+            if (m_seeking) {
+                m_seeking = false;
+                m_rebase = true;
+                if (m_active)
+                    m_consumer->reset_queue(m_pos);
+            }
+            return decode_status::ready;
+        case demux_event::end:
+            throw std::logic_error("End of input");
+        case demux_event::error:
             throw std::logic_error("Error read frame");
+        case demux_event::packet:
+            break;
+        }
+        const AVPacket& packet = *packet_ptr;
         
-        if (packet.stream_index != m_stream_index)
-            return;
+        ++m_stages->m_packets;
+        
+        if (m_active && m_consumer->catchup_requested(m_pos)) {
+            LOG("stream " << m_pos << " is behind, skip to next keyframe");
+            m_catchup = true;
+        }
         
-        ret = avcodec_send_packet(m_dec_ctx, &packet);
+        if (m_catchup) {
+            if (!(packet.flags & AV_PKT_FLAG_KEY))
+                return decode_status::ready;
+            
+            m_catchup = false;
+            m_rebase = true;
+            avcodec_flush_buffers(m_dec_ctx);
+        }
+        
+        reopen_codec_if_needed(packet);
+        
+        int64_t start = av_gettime_relative();
+        int64_t cpu = thread_cpu_us();
+        int ret = avcodec_send_packet(m_dec_ctx, &packet);
         if (ret < 0)
             throw std::logic_error("Error sending a packet for decoding");
+        m_stages->m_decode_us += thread_cpu_us() - cpu;
+        int64_t busy = av_gettime_relative() - start;
+        m_quality->add_busy(busy);
+        m_stats.m_decode_us.record(busy);
+        
+        m_receiving = true;
+        receive_frames();
+        
+        // stream with small jitter buffer has small lead by design
+        double min_lead = std::min(get_app_config().m_quality_min_lead_ms, m_clock.delay() / 2);
+        if (m_quality->update(av_gettime_relative(), min_lead))
+            apply_quality(m_dec_ctx);
         
-        while (ret >= 0) {
-            ret = avcodec_receive_frame(m_dec_ctx, m_frame.get());
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+        return decode_status::ready;
+    }
+    
+    void receive_frames()
+    {
+        while (!m_pending) {
+            int64_t start = av_gettime_relative();
+            AutoFree add_busy([this, start](){m_quality->add_busy(av_gettime_relative() - start);});
+
+            int64_t cpu = thread_cpu_us();
+            int ret = avcodec_receive_frame(m_dec_ctx, m_frame.get());
+            m_stages->m_decode_us += thread_cpu_us() - cpu;
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                m_receiving = false;
                 return;
+            }
             else if (ret < 0)
                 throw std::logic_error("Error during decoding");
+            m_stats.m_decode_us.record(av_gettime_relative() - start);
+            if (m_open_start)
+                first_frame_decoded();
             send_frame();
         }
     }
     
-    void send_frame(bool black = false)
+    bool flush_pending()
     {
-        AVFramePtr frame = make_frame_ptr(av_frame_alloc());
-
-        frame->format = AV_PIX_FMT_YUV420P;
-        frame->width  = get_app_config().m_dest_wight/2;
-        frame->height = get_app_config().m_dest_height/2;
-        
-        int ret = av_frame_get_buffer(frame.get(), 0);
-        if (ret < 0)
-            throw std::logic_error("Error allocate buffer");
-        
-        // prepare frame with need size in decode thread
-        sws_scale(m_sws,
-                    m_frame->data, m_frame->linesize,
-                    0, m_dec_ctx->height, 
-                    frame->data, frame->linesize);
-        if (black)
-        {
-            for (int y = 0; y < frame->height; y++) {
-                for (int x = 0; x < frame->width; x++) {
-                    frame->data[0][y * frame->linesize[0] + x] = 0;
-                }
-            }
+        if (m_pending && m_active && m_consumer->append_frame(m_pending, m_pos))
+            m_pending.reset();
+        return !m_pending;
+    }
     
-            for (int y = 0; y < frame->height/2; y++) {
-                for (int x = 0; x < frame->width/2; x++) {
-                    frame->data[1][y * frame->linesize[1] + x] = 0;
-                    frame->data[2][y * frame->linesize[2] + x] = 0;
-                }
+    // decoded frame to tile size and YUV420P, same size frames need no scaler
+    void convert_frame(AVFrame* dst)
+    {
+        const plane_kernels& ops = plane_ops();
+        const AVFrame* src = m_frame.get();
+        if (src->width == dst->width && src->height == dst->height) {
+            int chroma_w = (dst->width + 1) / 2;
+            int chroma_h = (dst->height + 1) / 2;
+            if (src->format == AV_PIX_FMT_YUV420P) {
+                ops.copy(dst->data[0], dst->linesize[0], src->data[0], src->linesize[0], dst->width, dst->height);
+                ops.copy(dst->data[1], dst->linesize[1], src->data[1], src->linesize[1], chroma_w, chroma_h);
+                ops.copy(dst->data[2], dst->linesize[2], src->data[2], src->linesize[2], chroma_w, chroma_h);
+                return;
+            }
+            if (src->format == AV_PIX_FMT_NV12) {
+                ops.copy(dst->data[0], dst->linesize[0], src->data[0], src->linesize[0], dst->width, dst->height);
+                ops.deinterleave_uv(dst->data[1], dst->linesize[1], dst->data[2], dst->linesize[2],
+                                    src->data[1], src->linesize[1], chroma_w, chroma_h);
+                return;
             }
         }
-
-        AVRational tb = m_dec_ctx->framerate;
-        if (!tb.den) {
-            tb.num = 24; // try guess
-            tb.den = 1;
+        
+        m_scaler.scale(src, dst, stream_scaler(m_pos));
+    }
+    
+    // limited range black, the only frame a decoder without codec can send
+    static void fill_black(AVFrame* frame)
+    {
+        const plane_kernels& ops = plane_ops();
+        ops.fill(frame->data[0], frame->linesize[0], frame->width, frame->height, 16);
+        ops.fill(frame->data[1], frame->linesize[1], (frame->width + 1) / 2, (frame->height + 1) / 2, 128);
+        ops.fill(frame->data[2], frame->linesize[2], (frame->width + 1) / 2, (frame->height + 1) / 2, 128);
+    }
+    
+    void send_frame(bool black = false)
+    {
+        // recycled frame, returns to the pool when consumer releases it
+        AVFramePtr frame = m_pool->get();
+        
+        if (black) {
+            fill_black(frame.get());
+            frame->pts = av_gettime() / 1000;
+            push_frame(frame);
+            return;
         }
-
-        double pts = m_frame_num/av_q2d(tb)*1000;
-        m_frame_num++;
+        
+        // prepare frame with need size in decode thread
+        int64_t start = av_gettime_relative();
+        int64_t cpu = thread_cpu_us();
+        convert_frame(frame.get());
+        m_stages->m_scale_us += thread_cpu_us() - cpu;
+        ++m_stages->m_frames;
+        m_stats.m_scale_us.record(av_gettime_relative() - start);
         
         double currtime = av_gettime() / 1000.0;
-        if (!m_decode_begin) {
-            m_decode_begin = currtime;
+        
+        AVRational fps = m_dec_ctx->framerate;
+        if (!fps.den || !fps.num) {
+            fps.num = 24; // try guess
+            fps.den = 1;
         }
+        double frame_interval = 1000 / av_q2d(fps);
+        
+        int64_t ts = m_frame->best_effort_timestamp;
+        double media = ts != AV_NOPTS_VALUE
+            ? ts * av_q2d(m_tb) * 1000
+            : m_clock.next_media(frame_interval);
+        
+        double pts = m_clock.present_time(media, currtime, frame_interval);
         
-        frame->pts = pts + m_decode_begin;
+        if (m_rebase) {
+            m_rebase = false;
+            if (pts < currtime) {
+                LOG("stream " << m_pos << " timeline moved by " << (int64_t)(currtime - pts) << " ms");
+                m_clock.rebase(media, currtime);
+                pts = currtime;
+            }
+        }
+        
+        frame->pts = pts;
+        
+        if (m_quality && m_last_pts)
+            m_quality->add_frame(pts - currtime, pts - m_last_pts);
             
-        m_last_pts = frame->pts;
+        m_last_pts = pts;
         
-        LOGD("frame pts " << pts << " show frame time " << frame->pts << " pic num " <<  m_frame->coded_picture_number);
-        m_consumer->append_frame(frame, m_pos);
+        LOGD("frame media " << media << " show frame time " << frame->pts << " delay " << m_clock.delay()
+             << " jitter " << m_clock.jitter() << " pic num " <<  m_frame->coded_picture_number);
+        push_frame(frame);
+    }
+    
+    void push_frame(AVFramePtr frame)
+    {
+        if (!m_active) {
+            m_pending = frame;  // first frame waits for activate()
+            return;
+        }
+        
+        if (m_consumer->append_frame(frame, m_pos))
+            return;
+        
+        if (get_app_config().m_queue_full_policy == queue_full_policy::drop || m_consumer->done()) {
+            LOGD("queue is full, frame dropped " << frame->pts);
+            return;
+        }
+        
+        m_pending = frame; // decoding stops until it gets into queue
     }
 };
 
 typedef std::shared_ptr<decoder> decoder_ptr;
 
+enum class command_type
+{
+    url,        // empty url stops the stream
+    threads,
+    pause,
+    resume,
+    seek,
+    quality,
+    record,
+    opened,     // background open of m_generation is finished, m_decoder is nullptr on failure
+};
+
+struct decoder_command
+{
+    command_type m_type;
+    std::string m_url;
+    int m_value = 0;            // threads, forced quality level or recording on/off
+    int64_t m_position_us = 0;  // seek
+    unsigned m_generation = 0;
+    decoder_ptr m_decoder;
+
+    explicit decoder_command(command_type type)
+        : m_type(type)
+    {}
+};
+
+// Everything that changes the stream comes as a command: console and config
+// lines as well as finished background opens. Commands are queued without
+// locks and taken by run(), so decoding state has a single owner.
 class decoder_context : public i_decoder_context
         , public std::enable_shared_from_this<decoder_context>
 {
     const i_frame_consumer_ptr m_consumer;
-    std::mutex m_mx;
-    unsigned m_last_url_check;
+    const i_worker_pool_ptr m_pool;
+    const i_worker_pool_ptr m_io_pool;  // opens inputs and reads packets
+    mpsc_queue<decoder_command> m_commands;
+    const std::shared_ptr<stage_counters> m_stages; // shared with decoders and their read tasks
+    const io_interrupt_ptr m_cancel;    // parent of inputs of all urls, cancelled by stop()
+    std::atomic<bool> m_scheduled;  // run() is queued or running
+    std::atomic<int> m_quality;     // mirrored from decoder for other threads
+    const stream_position m_pos;
+    stream_stats& m_stats;
+    const i_recorder_ptr m_recorder;    // follows the decoder which has the tile
+
+    // owned by run()
     std::string m_current_url;
-    std::string m_new_url;
+    unsigned m_url_generation = 0;  // counts accepted urls
+    unsigned m_ready_generation = 0;    // last url whose open is finished
+    io_interrupt_ptr m_opening;     // input of the newest url while it is opened
+    decoder_ptr m_candidate;        // new url decoding up to its first frame
     decoder_ptr m_decoder;
-    std::shared_ptr<std::thread> m_thread;
-    const stream_position m_pos;
+    int64_t m_switch_start = 0;     // av_gettime_relative of url change
+    int m_threads = -1;             // < 0 - from app config
+    int m_forced_quality = -1;      // < 0 - adaptive
+    bool m_paused = false;
+    bool m_recording = false;
 public:
-    decoder_context(std::shared_ptr<i_frame_consumer> consumer, stream_position pos)
+    decoder_context(i_worker_pool_ptr pool, i_worker_pool_ptr io_pool, i_frame_consumer_ptr consumer,
+                    stream_position pos)
         : m_consumer(consumer)
-        , m_last_url_check(0)
-        , m_thread()
+        , m_pool(pool)
+        , m_io_pool(io_pool)
+        , m_stages(std::make_shared<stage_counters>())
+        , m_cancel(std::make_shared<io_interrupt>())
+        , m_scheduled(false)
+        , m_quality(quality_full)
         , m_pos(pos)
+        , m_stats(get_stream_stats(pos))
+        , m_recorder(create_recorder(pos))
     {}
     
     ~decoder_context()
     {
-        if (m_thread)
-            m_thread->detach();
         LOG("~decoder_context " << this);
     }
     
     virtual void set_url(const std::string& url)
     {
-        std::unique_lock<std::mutex> lock(m_mx);
-        m_new_url = url;
+        decoder_command cmd(command_type::url);
+        cmd.m_url = url;
+        post_command(cmd);
+    }
+    
+    virtual void set_threads(int threads)
+    {
+        decoder_command cmd(command_type::threads);
+        cmd.m_value = threads;
+        post_command(cmd);
     }
     
-    void try_new_url()
+    virtual void pause()
     {
-        bool need_reinit = false;
-        if (m_last_url_check != time(NULL)) {
-            m_last_url_check == time(NULL);
-            std::unique_lock<std::mutex> lock(m_mx);
-            if (m_new_url != m_current_url) {
-                m_current_url = m_new_url;
-                need_reinit = true;
+        post_command(decoder_command(command_type::pause));
+    }
+    
+    virtual void resume()
+    {
+        post_command(decoder_command(command_type::resume));
+    }
+    
+    virtual void seek(double seconds)
+    {
+        decoder_command cmd(command_type::seek);
+        cmd.m_position_us = (int64_t)(seconds * 1000000);
+        post_command(cmd);
+    }
+    
+    virtual void set_quality(int level)
+    {
+        decoder_command cmd(command_type::quality);
+        cmd.m_value = level;
+        post_command(cmd);
+    }
+    
+    virtual int quality_level() const
+    {
+        return m_quality;
+    }
+    
+    virtual void record(bool on)
+    {
+        decoder_command cmd(command_type::record);
+        cmd.m_value = on;
+        post_command(cmd);
+    }
+    
+    virtual recorder_stats recording_stats() const
+    {
+        return m_recorder->stats();
+    }
+    
+    // decoders go away with the context, stop only makes their I/O return and finishes the recording
+    virtual void stop()
+    {
+        m_cancel->cancel();
+        m_recorder->stop();
+    }
+    
+    virtual decoder_stage_times stage_times() const
+    {
+        decoder_stage_times st;
+        st.m_packets = m_stages->m_packets;
+        st.m_frames = m_stages->m_frames;
+        st.m_demux_us = m_stages->m_demux_us;
+        st.m_decode_us = m_stages->m_decode_us;
+        st.m_scale_us = m_stages->m_scale_us;
+        return st;
+    }
+    
+    void post_command(const decoder_command& cmd)
+    {
+        m_commands.push(cmd);
+        schedule();
+    }
+    
+    // urls are coalesced, only the last one of the batch is opened
+    void process_commands()
+    {
+        std::vector<decoder_command> commands;
+        m_commands.pop_all(commands);
+        
+        bool has_url = false;
+        std::string url;
+        for (decoder_command& cmd : commands) {
+            // one failed command doesn't keep the others from running
+            try {
+                apply_command(cmd, has_url, url);
+            }
+            catch(std::exception& e) {
+                LOG_CONS("stream " << m_pos + 1 << " command failed: " << e.what());
             }
         }
 
-        if (need_reinit)
-            init_decoder();
-        
+        if (has_url && url != m_current_url)
+            accept_url(url);
     }
     
-    void produce()
+    // the last url command wins, it is applied after the others
+    void apply_command(decoder_command& cmd, bool& has_url, std::string& url)
     {
-        while(!m_consumer->done()) {
-            try_new_url();
-
-            if (!m_decoder) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                continue;
+        switch (cmd.m_type) {
+        case command_type::url:
+            has_url = true;
+            url = cmd.m_url;
+            break;
+        case command_type::threads:
+            m_threads = cmd.m_value;
+            break;
+        case command_type::pause:
+            m_paused = true;
+            LOG("stream " << m_pos << " paused");
+            break;
+        case command_type::resume:
+            if (m_paused && m_decoder)
+                m_decoder->resume();
+            m_paused = false;
+            LOG("stream " << m_pos << " resumed");
+            break;
+        case command_type::seek:
+            if (m_decoder)
+                m_decoder->seek(cmd.m_position_us);
+            break;
+        case command_type::quality:
+            m_forced_quality = cmd.m_value;
+            break;
+        case command_type::record:
+            m_recording = cmd.m_value != 0;
+            if (m_decoder)
+                m_decoder->record(m_recording ? m_recorder : i_recorder_ptr());
+            else
+            if (m_recording)
+                LOG_CONS("stream " << m_pos + 1 << " has no input, recording starts with its url");
+            LOG("stream " << m_pos << " recording " << (m_recording ? "on" : "off"));
+            break;
+        case command_type::opened:
+            // older generation is an url changed again while opening, its decoder just goes away
+            if (cmd.m_generation == m_url_generation) {
+                m_opening.reset();
+                m_ready_generation = cmd.m_generation;
+                m_candidate = std::move(cmd.m_decoder);
             }
-            
+            break;
+        }
+    }
+    
+    void accept_url(const std::string& url)
+    {
+        m_current_url = url;
+        init_decoder(++m_url_generation);
+    }
+    
+    // url is accepted but its decoder is not running yet
+    bool switching() const
+    {
+        return m_candidate || m_ready_generation != m_url_generation;
+    }
+    
+    void schedule()
+    {
+        if (!m_scheduled.exchange(true))
+            post();
+    }
+    
+    void post()
+    {
+        auto this_ptr = shared_from_this();
+        m_pool->post([this_ptr](){this_ptr->run();});
+    }
+    
+    void post_after(std::chrono::milliseconds delay)
+    {
+        auto this_ptr = shared_from_this();
+        m_pool->post_after(delay, [this_ptr](){this_ptr->run();});
+    }
+    
+    // one step of the stream on a pool worker, reposts itself while there is work
+    void run()
+    {
+        if (m_consumer->done() || m_cancel->cancelled())
+            return;
+        
+        process_commands();
+        
+        // paused stream still primes a new url, it takes the tile with its first frame
+        bool decoding = m_decoder && !m_paused;
+        if (!decoding && !m_candidate) {
+            // idle until the next command, it could come after the check above
+            m_scheduled = false;
+            if (!m_commands.empty())
+                schedule();
+            return;
+        }
+        
+        decode_status status = decode_status::starved;
+        if (m_candidate)
+            status = std::min(status, prime_candidate());
+        
+        if (decoding && m_decoder) {
             try
             {
-                m_decoder->decode_frame();
+                m_decoder->set_thread_setting(m_threads);
+                m_decoder->set_forced_quality(m_forced_quality);
+                status = std::min(status, m_decoder->decode_frame());
+                m_quality = m_decoder->quality_level();
             }
             catch(std::exception& e)
             {
                 LOG_CONS("Exception decode frame, producing stop " << e.what());
-                set_url("");
+                // pending switch still replaces the stream
+                if (switching())
+                    stop_decoder();
+                else
+                    accept_url("");
             }
         }
+        
+        switch (status) {
+        case decode_status::ready:
+            post();
+            break;
+        case decode_status::queue_full:
+            post_after(std::chrono::milliseconds(10));
+            break;
+        case decode_status::ahead:
+            post_after(std::chrono::milliseconds(50));
+            break;
+        case decode_status::starved:
+            // demuxer wakes the stream, packet could come before the flag is cleared
+            m_scheduled = false;
+            if (!m_commands.empty() || has_input())
+                schedule();
+            break;
+        }
+    }
+    
+    bool has_input() const
+    {
+        return (m_decoder && !m_paused && m_decoder->has_input()) || (m_candidate && m_candidate->has_input());
+    }
+    
+    void stop_decoder()
+    {
+        m_decoder.reset();
+        m_quality = quality_full;
     }
     
-    void start_thread()
+    // current decoder keeps the tile while the new url is opened and probed in background
+    void init_decoder(unsigned generation)
     {
+        m_candidate.reset();
+        // older url still opening is not going to be used
+        if (m_opening)
+            m_opening->cancel();
+        m_opening.reset();
+        
+        if (m_current_url.empty()) {
+            stop_decoder();
+            m_ready_generation = generation;
+            return;
+        }
+        
+        m_opening = std::make_shared<io_interrupt>(m_cancel);
+        m_switch_start = av_gettime_relative();
         auto this_ptr = shared_from_this();
-        m_thread = std::make_shared<std::thread>([this_ptr](){
-            register_current_thread(std::string("Decoder")+std::to_string((int)this_ptr->m_pos));
+        std::string url = m_current_url;
+        int threads = m_threads;
+        io_interrupt_ptr interrupt = m_opening;
+        m_io_pool->post([this_ptr, url, generation, threads, interrupt](){
+            this_ptr->open(url, generation, threads, interrupt);
+        });
+    }
+    
+    // io pool task, may run along with run() of the current decoder; the result comes back as command
+    void open(const std::string& url, unsigned generation, int threads, io_interrupt_ptr interrupt)
+    {
+        decoder_command cmd(command_type::opened);
+        cmd.m_generation = generation;
+        if (!m_consumer->done() && !interrupt->cancelled()) {
             try
             {
-                this_ptr->produce();
+                std::weak_ptr<decoder_context> weak_this = shared_from_this();
+                cmd.m_decoder = std::make_shared<decoder>(m_consumer, m_pos, m_stages);
+                cmd.m_decoder->init(url, threads, m_io_pool, interrupt, [weak_this](){
+                    if (auto this_ptr = weak_this.lock())
+                        this_ptr->schedule();
+                });
             }
             catch(std::exception& e)
             {
-                LOG_CONS("Exception on decoder thread " << e.what());
+                // cancelled open is an expected outcome of url change or shutdown
+                if (interrupt->cancelled()) {
+                    LOG(e.what());
+                } else {
+                    LOG_CONS(e.what());
+                }
+                cmd.m_decoder.reset();
             }
-            
-            LOG("Thread stopped " << std::this_thread::get_id());
-        });
+        }
+        
+        post_command(cmd);
     }
     
-    void init_decoder()
+    // new decoder runs up to its first frame, then takes the tile over
+    decode_status prime_candidate()
     {
-        m_decoder.reset();
-        if (m_current_url.empty())
-            return;
-        
+        decode_status status = decode_status::ready;
         try
         {
-            decoder_ptr dec_ptr = std::make_shared<decoder>(m_consumer, m_pos);
-            dec_ptr->init(m_current_url);
-            m_decoder = dec_ptr;
+            m_candidate->set_thread_setting(m_threads);
+            m_candidate->set_forced_quality(m_forced_quality);
+            status = m_candidate->decode_frame();
         }
         catch(std::exception& e)
         {
-            LOG_CONS(e.what());
+            LOG_CONS("Exception decode first frame of " << m_current_url << " " << e.what());
+            m_candidate.reset();
+            return decode_status::ahead;
         }
+        
+        if (!m_candidate->primed())
+            return status;
+        
+        if (m_decoder)
+            m_decoder->release_tile();
+        m_decoder.reset();
+        m_consumer->reset_queue(m_pos);
+        
+        m_decoder = std::move(m_candidate);
+        m_decoder->activate();
+        if (m_recording)
+            m_decoder->record(m_recorder);
+        m_quality = m_decoder->quality_level();
+        
+        int64_t switch_ms = (av_gettime_relative() - m_switch_start) / 1000;
+        m_stats.m_switch_ms.record(switch_ms);
+        LOG_CONS("stream " << m_pos << " switched to " << m_current_url << " in " << switch_ms << " ms");
+        return decode_status::ready;
     }
 };
 
-i_decoder_context_ptr start_decoder_thread(std::shared_ptr<i_frame_consumer> consumer, stream_position pos)
+i_decoder_context_ptr start_decoder(i_worker_pool_ptr pool, i_worker_pool_ptr io_pool,
+                                    i_frame_consumer_ptr consumer, stream_position pos)
 {
-    std::shared_ptr<decoder_context> decoder_ctx = std::make_shared<decoder_context>(consumer, pos);
-    decoder_ctx->start_thread();
-    return decoder_ctx;
+    return std::make_shared<decoder_context>(MANDATORY_PTR(pool), MANDATORY_PTR(io_pool), consumer, pos);
 }
 
 }
@@ -0,0 +1,357 @@
+#include "demuxer.h"
+#include <mutex>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+
+#include "ffmpeg_afx.h"
+#include "worker_pool.h"
+#include "stats.h"
+#include "recorder.h"
+
+namespace mstream
+{
+
+namespace
+{
+
+const int read_batch = 16;      // packets per task, the repost queues behind other streams of the worker
+const int max_retries = 5;
+
+std::string error_text(int err)
+{
+    char buf[256];
+    if (av_strerror(err, buf, sizeof(buf)) < 0)
+        return std::to_string(err);
+    return buf;
+}
+
+int interrupt_callback(void* opaque)
+{
+    const io_interrupt* interrupt = (const io_interrupt*)opaque;
+    return interrupt->cancelled() || interrupt->expired();
+}
+
+}
+
+io_interrupt::io_interrupt(std::shared_ptr<io_interrupt> parent)
+    : m_parent(parent)
+    , m_cancel_time(0)
+    , m_deadline(0)
+{}
+
+void io_interrupt::cancel()
+{
+    int64_t running = 0;
+    m_cancel_time.compare_exchange_strong(running, av_gettime_relative());
+}
+
+bool io_interrupt::cancelled() const
+{
+    return m_cancel_time || (m_parent && m_parent->cancelled());
+}
+
+int64_t io_interrupt::cancel_time() const
+{
+    int64_t own = m_cancel_time;
+    int64_t parent = m_parent ? m_parent->cancel_time() : 0;
+    return own && parent ? std::min(own, parent) : std::max(own, parent);
+}
+
+void io_interrupt::set_timeout(int64_t timeout_ms)
+{
+    m_deadline = timeout_ms ? av_gettime_relative() + timeout_ms * 1000 : 0;
+}
+
+bool io_interrupt::expired() const
+{
+    int64_t deadline = m_deadline;
+    return deadline && av_gettime_relative() > deadline;
+}
+
+void io_interrupt::attach(AVFormatContext* fmt)
+{
+    fmt->interrupt_callback.callback = interrupt_callback;
+    fmt->interrupt_callback.opaque = this;
+}
+
+class demuxer : public i_demuxer
+        , public std::enable_shared_from_this<demuxer>
+{
+    struct item
+    {
+        demux_event m_event;
+        AVPacketPtr m_packet;
+    };
+
+    const i_worker_pool_ptr m_pool;
+    AVFormatContext* m_fmt;
+    const io_interrupt_ptr m_interrupt; // of m_fmt, stop() cancels it
+    const int m_stream_index;
+    const stream_position m_pos;
+    const std::function<void()> m_wake;
+    const std::shared_ptr< std::atomic<int64_t> > m_cpu_us;
+    stream_stats& m_stats;
+    std::atomic<int64_t> m_seek_us;     // AV_NOPTS_VALUE - none
+
+    mutable std::mutex m_mx;
+    std::deque<item> m_items;   // guarded by m_mx
+    size_t m_bytes = 0;         // guarded by m_mx
+    bool m_parked = false;      // guarded by m_mx, reading waits for low water
+    bool m_waiting = false;     // guarded by m_mx, decoder found the queue empty
+    bool m_ended = false;       // guarded by m_mx, end or error pushed, no read task until seek()
+    i_recorder_ptr m_recorder;  // guarded by m_mx
+
+    int m_failures = 0;         // io task only
+public:
+    demuxer(i_worker_pool_ptr pool, AVFormatContext* fmt, io_interrupt_ptr interrupt, int stream_index,
+            stream_position pos, std::function<void()> wake, std::shared_ptr< std::atomic<int64_t> > cpu_us)
+        : m_pool(pool)
+        , m_fmt(fmt)
+        , m_interrupt(interrupt)
+        , m_stream_index(stream_index)
+        , m_pos(pos)
+        , m_wake(wake)
+        , m_cpu_us(cpu_us)
+        , m_stats(get_stream_stats(pos))
+        , m_seek_us(AV_NOPTS_VALUE)
+    {}
+
+    // the last reference goes away with the decoder or with the read task, which returns right after cancel
+    ~demuxer()
+    {
+        avformat_close_input(&m_fmt);
+        int64_t cancel_time = m_interrupt->cancel_time();
+        if (cancel_time)
+            m_stats.m_stop_ms.record((av_gettime_relative() - cancel_time) / 1000);
+    }
+
+    virtual demux_event pop(AVPacketPtr& packet)
+    {
+        bool resume = false;
+        demux_event event;
+        {
+            std::unique_lock<std::mutex> lock(m_mx);
+            if (m_items.empty()) {
+                m_waiting = true;
+                return demux_event::none;
+            }
+
+            item& front = m_items.front();
+            event = front.m_event;
+            packet = std::move(front.m_packet);
+            if (packet)
+                m_bytes -= packet->size;
+            m_items.pop_front();
+            m_stats.m_packet_queue_kb.record(m_bytes / 1024);
+
+            if (m_parked && m_bytes <= get_app_config().m_packet_queue_low_kb * 1024) {
+                m_parked = false;
+                resume = true;
+            }
+        }
+
+        if (resume)
+            post();
+        return event;
+    }
+
+    virtual bool has_items() const
+    {
+        std::unique_lock<std::mutex> lock(m_mx);
+        return !m_items.empty();
+    }
+
+    virtual size_t queued_bytes() const
+    {
+        std::unique_lock<std::mutex> lock(m_mx);
+        return m_bytes;
+    }
+
+    virtual void seek(int64_t position_us)
+    {
+        m_seek_us = position_us;
+
+        // parked or ended reading has no task to notice the request
+        bool resume = false;
+        {
+            std::unique_lock<std::mutex> lock(m_mx);
+            resume = m_parked || m_ended;
+            m_parked = false;
+            m_ended = false;
+        }
+        if (resume)
+            post();
+    }
+
+    virtual void record(i_recorder_ptr recorder)
+    {
+        std::unique_lock<std::mutex> lock(m_mx);
+        m_recorder = recorder;
+    }
+
+    virtual void stop()
+    {
+        m_interrupt->cancel();
+    }
+
+    void post()
+    {
+        auto this_ptr = shared_from_this();
+        m_pool->post([this_ptr](){this_ptr->read();});
+    }
+
+private:
+    void post_after(std::chrono::milliseconds delay)
+    {
+        auto this_ptr = shared_from_this();
+        m_pool->post_after(delay, [this_ptr](){this_ptr->read();});
+    }
+
+    void push(demux_event event, AVPacketPtr packet = AVPacketPtr())
+    {
+        bool wake = false;
+        {
+            std::unique_lock<std::mutex> lock(m_mx);
+            if (packet) {
+                m_bytes += packet->size;
+                // under the lock, so no packet reaches the recorder after record() replaced it;
+                // the recorder shares the packet with the decoder, neither changes it
+                if (m_recorder)
+                    m_recorder->push_packet(packet);
+            }
+            if (event == demux_event::end || event == demux_event::error)
+                m_ended = true;
+            item it = {event, packet};
+            m_items.push_back(it);
+            wake = m_waiting;
+            m_waiting = false;
+        }
+
+        if (wake)
+            m_wake();
+    }
+
+    bool above_high_water()
+    {
+        std::unique_lock<std::mutex> lock(m_mx);
+        if (m_bytes < get_app_config().m_packet_queue_high_kb * 1024)
+            return false;
+        m_parked = true;
+        return true;
+    }
+
+    // io pool task, reposts itself until the queue is full or the input ends
+    void read()
+    {
+        for (int i = 0; i < read_batch; ++i) {
+            if (m_interrupt->cancelled())
+                return;
+
+            int64_t seek_us = m_seek_us.exchange(AV_NOPTS_VALUE);
+            if (seek_us != AV_NOPTS_VALUE)
+                seek_input(seek_us);
+
+            if (above_high_water())
+                return;
+
+            AVPacketPtr packet = make_packet_ptr(av_packet_alloc());
+            if (!packet) {
+                push(demux_event::error);
+                return;
+            }
+
+            int64_t start = av_gettime_relative();
+            int64_t cpu = thread_cpu_us();
+            m_interrupt->set_timeout(get_app_config().m_read_timeout_ms);
+            int ret = av_read_frame(m_fmt, packet.get());
+            bool timed_out = ret == AVERROR_EXIT && m_interrupt->expired();
+            m_interrupt->set_timeout(0);
+            *m_cpu_us += thread_cpu_us() - cpu;
+            m_stats.m_read_us.record(av_gettime_relative() - start);
+
+            if (m_interrupt->cancelled())
+                return;
+
+            if (ret == AVERROR(EAGAIN)) {
+                post_after(std::chrono::milliseconds(10));
+                return;
+            }
+
+            if (ret == AVERROR_EOF) {
+                if (get_app_config().m_loop_input && restart_input()) {
+                    push(demux_event::restart);
+                    continue;
+                }
+                push(get_app_config().m_loop_input ? demux_event::error : demux_event::end);
+                return;
+            }
+
+            if (ret < 0) {
+                std::string error = timed_out ? "timeout" : error_text(ret);
+                if (++m_failures > max_retries) {
+                    LOG_CONS("stream " << m_pos << " read failed " << error);
+                    push(demux_event::error);
+                    return;
+                }
+                LOG("stream " << m_pos << " read error " << error << ", retry " << m_failures);
+                post_after(std::chrono::milliseconds(100 * m_failures));
+                return;
+            }
+
+            m_failures = 0;
+            if (packet->stream_index == m_stream_index)
+                push(demux_event::packet, packet);
+        }
+
+        post();
+    }
+
+    void seek_input(int64_t position_us)
+    {
+        int64_t start = m_fmt->start_time != AV_NOPTS_VALUE ? m_fmt->start_time : 0;
+        m_interrupt->set_timeout(get_app_config().m_read_timeout_ms);
+        int ret = av_seek_frame(m_fmt, -1, start + position_us, AVSEEK_FLAG_BACKWARD);
+        m_interrupt->set_timeout(0);
+        if (ret < 0) {
+            LOG_CONS("stream " << m_pos << " cannot seek to " << position_us / 1000 << " ms " << error_text(ret));
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(m_mx);
+            m_items.clear();
+            m_bytes = 0;
+        }
+        push(demux_event::restart);
+        LOG("stream " << m_pos << " seek to " << position_us / 1000 << " ms");
+    }
+
+    // timestamps jump back, decoder sees it as discontinuity
+    bool restart_input()
+    {
+        AVStream* stream = m_fmt->streams[m_stream_index];
+        int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+        m_interrupt->set_timeout(get_app_config().m_read_timeout_ms);
+        int ret = av_seek_frame(m_fmt, m_stream_index, start, AVSEEK_FLAG_BACKWARD);
+        m_interrupt->set_timeout(0);
+        if (ret < 0) {
+            LOG_CONS("stream " << m_pos << " cannot restart input");
+            return false;
+        }
+        LOGD("stream " << m_pos << " input restarted");
+        return true;
+    }
+};
+
+i_demuxer_ptr start_demuxer(i_worker_pool_ptr io_pool, AVFormatContext* fmt, io_interrupt_ptr interrupt,
+                            int stream_index, stream_position pos, std::function<void()> wake,
+                            std::shared_ptr< std::atomic<int64_t> > cpu_us)
+{
+    auto dmx = std::make_shared<demuxer>(MANDATORY_PTR(io_pool), fmt, MANDATORY_PTR(interrupt), stream_index,
+                                         pos, wake, cpu_us);
+    dmx->post();
+    return dmx;
+}
+
+}
@@ -1,222 +1,313 @@
 #include "encoder.h"
+#include "frame_pool.h"
 #include "ffmpeg_afx.h"
 #include "common.h"
+#include "spsc_ring.h"
+#include "stats.h"
+#include "plane_ops.h"
+#include "snapshot.h"
+#include "mpsc_queue.h"
 
-#include <mutex>
 #include <thread>
-#include <list>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
 #include <algorithm>
+#include <string>
 
 #include <SDL/SDL.h>
 
-#define FF_REFRESH_EVENT (SDL_USEREVENT + 1)
-
-static uint32_t sdl_refresh_timer(uint32_t interval, void *opaque) {
-  SDL_Event event;
-  event.type = FF_REFRESH_EVENT;
-  event.user.data1 = opaque;
-  SDL_PushEvent(&event);
-  return 0;
-}
-
 namespace mstream
 {
 
-extern bool g_unloaded;
-
-static void pgm_save(unsigned char *buf, int wrap, int xsize, int ysize,
-                     char *filename)
-{
-    FILE *f;
-    int i;
-
-    f = fopen(filename,"w");
-    fprintf(f, "P5\n%d %d\n%d\n", xsize, ysize, 255);
-    for (i = 0; i < ysize; i++)
-        fwrite(buf + i * wrap, 1, xsize, f);
-    fclose(f);
-}
-
-struct FrameInfo
-{
-    AVFramePtr m_frame;
-    stream_position m_pos;
-};
-
-
-class encoder
+// Mosaic canvas, shown in SDL overlay or kept in memory when there is no display
+class presenter
 {
     SDL_Overlay* m_bmp = nullptr;
-    SwsContext*  m_img_convert_context = nullptr;
-    AVFramePtr m_frame;
-    unsigned m_frame_num = 0;
-    int m_linesize[4];
-    int m_height[4];
+    AVFrame* m_memory_canvas = nullptr;
     int m_nb_planes;
+    int m_log2_chroma_w;
+    int m_log2_chroma_h;
     SDL_Rect m_rect;
+    // overlay planes in YUV420P order, tiles are composed right here
+    uint8_t* m_canvas[3];
+    int m_canvas_linesize[3];
     
 public:
-    encoder()
+    presenter()
     {}
     
-    ~encoder()
+    ~presenter()
     {
         if (m_bmp)
             SDL_FreeYUVOverlay(m_bmp);
-        if (m_img_convert_context)
-            sws_freeContext(m_img_convert_context);
-        g_unloaded = true;
+        av_frame_free(&m_memory_canvas);
+    }
+    
+    bool has_display() const
+    {
+        return m_bmp;
     }
     
     void init_player()
     {
-        m_frame = make_frame_ptr(av_frame_alloc());
-        if (!m_frame)
-            THROW_ERR("Error frame allocate");
-
-        m_frame->format = AV_PIX_FMT_YUV420P;
-        m_frame->width  = get_app_config().m_dest_wight;
-        m_frame->height = get_app_config().m_dest_height;
-        if (av_frame_get_buffer(m_frame.get(), 0)<0)
-            THROW_ERR("Error frame allocate");
-
         m_nb_planes = av_pix_fmt_count_planes(AV_PIX_FMT_YUV420P);
 
-        av_image_fill_linesizes(m_linesize, AV_PIX_FMT_YUV420P, get_app_config().m_dest_wight/2);
         const AVPixFmtDescriptor* fmt_desc = av_pix_fmt_desc_get(AV_PIX_FMT_YUV420P);
-
-        m_height[1] = m_height[2] = AV_CEIL_RSHIFT(get_app_config().m_dest_height/2, fmt_desc->log2_chroma_h);
-        m_height[0] = m_height[3] = get_app_config().m_dest_height/2;
+        m_log2_chroma_w = fmt_desc->log2_chroma_w;
+        m_log2_chroma_h = fmt_desc->log2_chroma_h;
+        
+        m_rect.x = 0;
+        m_rect.y = 0;
+        m_rect.w = get_app_config().m_dest_wight;
+        m_rect.h = get_app_config().m_dest_height;
         
+        if (get_app_config().m_display)
+            init_display();
+        else
+            init_memory_canvas();
+
+        // canvas keeps its content between displays, start from black picture
+        lock_canvas();
+        for (int p = 0; p < m_nb_planes; p++)
+            plane_ops().fill(m_canvas[p], m_canvas_linesize[p], plane_width(p, m_rect.w), plane_height(p, m_rect.h),
+                             p ? 128 : 16);
+        unlock_canvas();
+    }
+
+    void init_display()
+    {
         int ret = SDL_Init(SDL_INIT_VIDEO);
         
         if (ret < 0)
             THROW_ERR("Unable to init SDL" << SDL_GetError());
 
-        SDL_Surface* screen = SDL_SetVideoMode(get_app_config().m_dest_wight, get_app_config().m_dest_height, 0, 0);
+        SDL_Surface* screen = SDL_SetVideoMode(m_rect.w, m_rect.h, 0, 0);
         if (screen == NULL)
             THROW_ERR("Couldn't set video mode");
 
-        m_rect.x = 0;
-        m_rect.y = 0;
-        m_rect.w = get_app_config().m_dest_wight;
-        m_rect.h = get_app_config().m_dest_height;
-        
-        m_bmp = SDL_CreateYUVOverlay(get_app_config().m_dest_wight, get_app_config().m_dest_height,
-            SDL_YV12_OVERLAY, screen);
-        m_img_convert_context = sws_getCachedContext(NULL,
-                            get_app_config().m_dest_wight, get_app_config().m_dest_height,
-                                            AV_PIX_FMT_YUV420P,
-                                            get_app_config().m_dest_wight, get_app_config().m_dest_height,
-                                            AV_PIX_FMT_YUV420P, SWS_BICUBIC,
-                                            NULL, NULL, NULL);
-        
-        if (!m_img_convert_context)
-            THROW_ERR("Couldn't create img converter");
+        m_bmp = SDL_CreateYUVOverlay(m_rect.w, m_rect.h, SDL_YV12_OVERLAY, screen);
+        if (!m_bmp)
+            THROW_ERR("Couldn't create overlay");
+    }
+
+    void init_memory_canvas()
+    {
+        m_memory_canvas = av_frame_alloc();
+        if (!m_memory_canvas)
+            THROW_ERR("Error frame allocate");
+
+        m_memory_canvas->format = AV_PIX_FMT_YUV420P;
+        m_memory_canvas->width = m_rect.w;
+        m_memory_canvas->height = m_rect.h;
+        if (av_frame_get_buffer(m_memory_canvas, 32) < 0)
+            THROW_ERR("Error allocate canvas");
     }
 
-    void prepare_bmp(AVFramePtr frame, stream_position pos)
+    // overlay pixels are valid only while it is locked
+    void lock_canvas()
+    {
+        if (!m_bmp) {
+            for (int p = 0; p < m_nb_planes; p++) {
+                m_canvas[p] = m_memory_canvas->data[p];
+                m_canvas_linesize[p] = m_memory_canvas->linesize[p];
+            }
+            return;
+        }
+
+        SDL_LockYUVOverlay(m_bmp);
+        m_canvas[0] = m_bmp->pixels[0];
+        m_canvas[1] = m_bmp->pixels[2];  // it's because YV12
+        m_canvas[2] = m_bmp->pixels[1];
+        m_canvas_linesize[0] = m_bmp->pitches[0];
+        m_canvas_linesize[1] = m_bmp->pitches[2];
+        m_canvas_linesize[2] = m_bmp->pitches[1];
+    }
+
+    void begin_compose()
+    {
+        lock_canvas();
+    }
+
+    void unlock_canvas()
+    {
+        if (m_bmp)
+            SDL_UnlockYUVOverlay(m_bmp);
+    }
+
+    void end_compose()
+    {
+        unlock_canvas();
+    }
+
+    // snapshot of the whole canvas for the output encoder
+    void copy_canvas(AVFrame* dst)
+    {
+        lock_canvas();
+        for (int p = 0; p < m_nb_planes; p++)
+            plane_ops().copy(dst->data[p], dst->linesize[p],
+                             m_canvas[p], m_canvas_linesize[p],
+                             plane_width(p, m_rect.w), plane_height(p, m_rect.h));
+        unlock_canvas();
+    }
+
+    // copy tile straight into its region of the overlay, call between begin_compose/end_compose
+    void compose_tile(AVFramePtr frame, stream_position pos)
     {
         if (!frame)
             return;
 
-        std::function<int(int)> offset;
-
-        switch (pos) {
-        case stream_pos_tl:
-            offset = [this](int p)->int {return 0;};
-            break;
-        case stream_pos_tr:
-            offset = [this](int p)->int {return m_linesize[p];};
-            break;
-        case stream_pos_bl:
-            offset = [this](int p)->int {return m_height[p] * m_frame->linesize[p];};
-            break;
-        case stream_pos_br:
-            offset = [this](int p)->int {return m_height[p] * m_frame->linesize[p] + m_linesize[p];};
-            break;
-        default:
+        if (pos >= stream_count())
             return;
-        }
+
+        const tile_rect& tile = get_app_config().m_tiles[pos];
+        const int border = get_app_config().m_tile_border;
+        const plane_kernels& ops = plane_ops();
         
         for (int p = 0; p < m_nb_planes; p++) {
-            av_image_copy_plane(m_frame->data[p] + offset(p),
-                                m_frame->linesize[p],
-                                frame->data[p],
-                                frame->linesize[p],
-                                m_linesize[p], m_height[p]);
+            int offset = plane_height(p, tile.m_y) * m_canvas_linesize[p] + plane_width(p, tile.m_x);
+            ops.copy(m_canvas[p] + offset,
+                     m_canvas_linesize[p],
+                     frame->data[p],
+                     frame->linesize[p],
+                     plane_width(p, tile.m_width), plane_height(p, tile.m_height));
+            if (border)
+                draw_border(m_canvas[p], m_canvas_linesize[p],
+                            plane_width(p, tile.m_x), plane_height(p, tile.m_y),
+                            plane_width(p, tile.m_width), plane_height(p, tile.m_height),
+                            plane_width(p, border), p ? 128 : 16);
         }
-
-        SDL_LockYUVOverlay(m_bmp);
-       
-        // Convert frame to YV12 pixel format for display in SDL overlay
-        uint8_t *pixels[3];
-        pixels[0] = m_bmp->pixels[0];
-        pixels[1] = m_bmp->pixels[2];  // it's because YV12
-        pixels[2] = m_bmp->pixels[1];
-        
-        int linesize[3];
-        linesize[0] = m_bmp->pitches[0];
-        linesize[1] = m_bmp->pitches[2];
-        linesize[2] = m_bmp->pitches[1];
-        
-        sws_scale(m_img_convert_context,
-                                m_frame->data, m_frame->linesize,
-                                0, get_app_config().m_dest_height,
-                                pixels, linesize);
-       
-        SDL_UnlockYUVOverlay(m_bmp);
     }
     
-    void display_frame()
+    int plane_width(int plane, int width) const
     {
-        SDL_DisplayYUVOverlay(m_bmp, &m_rect);
+        return plane ? AV_CEIL_RSHIFT(width, m_log2_chroma_w) : width;
+    }
+
+    int plane_height(int plane, int height) const
+    {
+        return plane ? AV_CEIL_RSHIFT(height, m_log2_chroma_h) : height;
     }
     
-    void process_frame_png(AVFrame* frame)
+    void display_frame()
     {
-        ++m_frame_num;
-        if (!(m_frame_num%20))
-            return;
-        char buf[255];
-        snprintf(buf, sizeof(buf), "%s-%d", "out", ++m_frame_num);
-        pgm_save(frame->data[0], frame->linesize[0],
-                 frame->width, frame->height, buf);
+        if (m_bmp)
+            SDL_DisplayYUVOverlay(m_bmp, &m_rect);
     }
 };
 
+struct queued_frame
+{
+    AVFramePtr m_frame;
+    int64_t m_queued_us = 0;    // av_gettime_relative of append_frame
+};
+
+typedef spsc_ring<queued_frame> frame_ring;
+
+struct stream_slot
+{
+    // decoder task is producer, consumer thread is consumer
+    frame_ring m_frames;
+    stream_stats& m_stats;
+    std::atomic<bool> m_catchup;
+    int64_t m_behind_since = 0;     // ms, consumer thread only
+    AVFramePtr m_last_frame;        // consumer thread only, the tile as shown, kept for snapshots
+    std::atomic<uint64_t> m_shown;
+    std::atomic<uint64_t> m_late;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<uint64_t> m_catchups;
+    std::atomic<int64_t> m_compose_us;
+
+    explicit stream_slot(stream_position pos)
+        : m_frames(get_app_config().m_max_frames_in_queue)
+        , m_stats(get_stream_stats(pos))
+        , m_catchup(false)
+        , m_shown(0)
+        , m_late(0)
+        , m_dropped(0)
+        , m_catchups(0)
+        , m_compose_us(0)
+    {}
+};
+
 class frame_consumer : public i_frame_consumer_master
-        , public std::enable_shared_from_this<frame_consumer>
 {
-    bool m_done = false;
-    std::mutex m_mx;
-    std::shared_ptr<encoder> m_encoder;
-    std::shared_ptr<std::thread> m_thread;
-    std::vector< std::list<AVFramePtr> > m_streams_frames;
+    typedef std::chrono::steady_clock clock;
+
+    std::atomic<bool> m_done;
+    // the consumer thread sleeps on m_wake_cv between frames and ticks
+    std::mutex m_wake_mx;
+    std::condition_variable m_wake_cv;
+    bool m_wake = false;            // guarded by m_wake_mx
+    std::atomic<bool> m_sleeping;   // waits for appended frames too
+    consumer_stats& m_stats;
+    std::shared_ptr<presenter> m_presenter;     // consumer thread only
+    std::thread m_thread;
+    std::vector< std::unique_ptr<stream_slot> > m_streams;
+    i_output_ptr m_output;
+    i_frame_pool_ptr m_output_pool;
+    i_snapshot_writer_ptr m_snapshots;
+    mpsc_queue<int> m_snapshot_requests;    // stream position, -1 - mosaic
+    i_frame_pool_ptr m_snapshot_pool;       // canvas copies, consumer thread only
+    clock::time_point m_next_thumbnail;     // consumer thread only
+    size_t m_thumbnail_pos = 0;             // stream position, stream count - mosaic
     
 public:
-    frame_consumer()
-        : m_streams_frames(4)
-    {}
+    frame_consumer(i_output_ptr output)
+        : m_done(false)
+        , m_sleeping(false)
+        , m_stats(get_consumer_stats())
+        , m_streams(stream_count())
+        , m_output(output)
+        , m_snapshots(start_snapshot_writer())
+    {
+        for (size_t i = 0; i < m_streams.size(); ++i)
+            m_streams[i].reset(new stream_slot((stream_position)i));
+    }
     
     ~frame_consumer()
     {
-        if (m_thread)
-            m_thread->detach();
+        stop();
         LOG("~frame_consumer " << this);
     }
     
-    virtual void append_frame(AVFramePtr frame, stream_position pos)
+    virtual bool append_frame(AVFramePtr frame, stream_position pos)
     {
-        std::unique_lock<std::mutex> lock(m_mx);
-        
-        m_streams_frames[pos].push_back(frame);
+        queued_frame item;
+        item.m_frame = frame;
+        item.m_queued_us = av_gettime_relative();
+        if (!m_streams[pos]->m_frames.push(item))
+            return false;
+
+        // pairs with the fence in wait_for_work, either the consumer sees the frame or we see it sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_sleeping.load(std::memory_order_relaxed))
+            wake();
+        return true;
     }
     
     virtual void reset_queue(stream_position pos)
     {
-        std::unique_lock<std::mutex> lock(m_mx);
-        m_streams_frames[pos].clear();
+        m_streams[pos]->m_frames.discard();
+    }
+    
+    virtual bool catchup_requested(stream_position pos)
+    {
+        return m_streams[pos]->m_catchup.exchange(false);
+    }
+    
+    virtual frame_counters counters(stream_position pos) const
+    {
+        const stream_slot& slot = *m_streams[pos];
+        frame_counters c;
+        c.m_shown = slot.m_shown;
+        c.m_late = slot.m_late;
+        c.m_dropped = slot.m_dropped;
+        c.m_catchups = slot.m_catchups;
+        c.m_compose_us = slot.m_compose_us;
+        return c;
     }
     
     virtual bool done() const
@@ -227,82 +318,288 @@ public:
     virtual void set_done()
     {
         m_done = true;
+        wake();
+    }
+    
+    void wake()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_wake_mx);
+            m_wake = true;
+        }
+        m_wake_cv.notify_one();
+    }
+    
+    virtual void stop()
+    {
+        set_done();
+        if (m_thread.joinable())
+            m_thread.join();
+        m_snapshots->stop();
+    }
+    
+    virtual void snapshot(stream_position pos)
+    {
+        m_snapshot_requests.push((int)pos);
+        wake();
+    }
+    
+    virtual void snapshot_mosaic()
+    {
+        m_snapshot_requests.push(-1);
+        wake();
+    }
+    
+    virtual snapshot_stats snapshot_counters() const
+    {
+        return m_snapshots->stats();
     }
     
+    // joined by stop() or the destructor
     void start_thread()
     {
-        auto this_ptr = shared_from_this();
-        m_thread = std::make_shared<std::thread>([this_ptr](){
+        m_thread = std::thread([this](){
             register_current_thread("Frame consumer");
             
             LOG("Thread consumer started " << std::this_thread::get_id());
             try {
-                this_ptr->consume();
+                consume();
             } 
             catch(...) {
                 LOG_CONS("consumer thread failed");
             }
+            // display goes away on the thread which created it
+            m_presenter.reset();
             
             LOG("Thread consumer stopped " << std::this_thread::get_id());
         });
     }
     
-    bool process_next_frame()
+    // newest due frame of the stream, older due frames are superseded by it,
+    // too late frame is dropped and stream asked to catch up if it stays behind
+    queued_frame take_due_frame(stream_slot& slot, int64_t currtime)
     {
-        FrameInfo fi;
-        AVFramePtr top_frame;
-        size_t ind;
+        const app_config& cfg = get_app_config();
+        queued_frame due;
+        queued_frame* frame;
+        while ((frame = slot.m_frames.front()) && frame->m_frame->pts <= currtime) {
+            if (due.m_frame)
+                ++slot.m_dropped;
+            due = *frame;
+            slot.m_frames.pop();
+        }
+
+        if (!due.m_frame)
+            return due;
+
+        int64_t lateness = currtime - due.m_frame->pts;
+        if (lateness <= cfg.m_late_drop_ms) {
+            slot.m_behind_since = 0;
+            ++slot.m_shown;
+            if (lateness * cfg.m_output_fps > 1000)
+                ++slot.m_late;
+            return due;
+        }
+
+        ++slot.m_dropped;
+        if (!slot.m_behind_since) {
+            slot.m_behind_since = currtime;
+        }
+        else
+        if (currtime - slot.m_behind_since > cfg.m_catchup_after_ms) {
+            LOGD("stream catch up, late " << lateness);
+            slot.m_behind_since = 0;
+            slot.m_catchup = true;
+            ++slot.m_catchups;
+        }
         
-        std::unique_lock<std::mutex> lock(m_mx);
-        for (size_t i = 0; i < m_streams_frames.size(); ++i) {
-            std::list<AVFramePtr>& sframes = m_streams_frames[i];
-            if (sframes.empty())
-                continue;
-
-            if (sframes.size() > 50)
-                LOGD("size for queue " << i << " is " << sframes.size());
-
-            AVFramePtr frame = sframes.front();
-            if (!top_frame || frame->pts < top_frame->pts) {
-                top_frame = frame;
-                ind = i;
+        return queued_frame();
+    }
+
+    // without pacing every queued frame is shown, nothing is late
+    queued_frame take_next_frame(stream_slot& slot)
+    {
+        queued_frame* frame = slot.m_frames.front();
+        if (!frame)
+            return queued_frame();
+
+        queued_frame next = *frame;
+        slot.m_frames.pop();
+        ++slot.m_shown;
+        return next;
+    }
+
+    bool compose_due_frames()
+    {
+        int64_t currtime = av_gettime() / 1000;
+        bool paced = get_app_config().m_paced;
+        bool composed = false;
+
+        for (size_t i = 0; i < m_streams.size(); ++i) {
+            stream_slot& slot = *m_streams[i];
+            slot.m_stats.m_queue_depth.record(slot.m_frames.size());
+
+            queued_frame due = paced ? take_due_frame(slot, currtime) : take_next_frame(slot);
+            while (due.m_frame) {
+                if (!composed)
+                    m_presenter->begin_compose();
+                composed = true;
+
+                const AVFramePtr& frame = due.m_frame;
+                LOGD("compose stream " << i << " pts " << frame->pts << " late " << (currtime - frame->pts));
+                int64_t start = av_gettime_relative();
+                int64_t cpu = thread_cpu_us();
+                m_presenter->compose_tile(frame, (stream_position)i);
+                slot.m_compose_us += thread_cpu_us() - cpu;
+                slot.m_last_frame = frame;
+
+                slot.m_stats.m_compose_us.record(av_gettime_relative() - start);
+                slot.m_stats.m_queue_wait_us.record(start - due.m_queued_us);
+                if (paced)
+                    slot.m_stats.m_present_delay_us.record(av_gettime() - frame->pts * 1000);
+
+                due = paced ? queued_frame() : take_next_frame(slot);
             }
         }
-        
-        if (top_frame)
-            m_streams_frames[ind].pop_front();
-        
-        lock.unlock();
 
-        if (top_frame) {
-            int64_t pts = top_frame->pts;
-            
-            m_encoder->prepare_bmp(top_frame, (stream_position)ind);
+        if (composed)
+            m_presenter->end_compose();
+
+        return composed;
+    }
+    
+    // pts of the earliest frame at the queue fronts, false if all queues are empty
+    bool earliest_queued_pts(int64_t& pts)
+    {
+        bool found = false;
+        for (auto& slot : m_streams) {
+            queued_frame* frame = slot->m_frames.front();
+            if (frame && (!found || frame->m_frame->pts < pts)) {
+                pts = frame->m_frame->pts;
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    // Sleeps until there is something to do: the next tick when the canvas goes to
+    // output or display, a queued frame becoming due (paced) or being appended (not paced),
+    // or wake(). Display events are picked up on ticks, SDL 1.2 has no waiting with timeout.
+    void wait_for_work(bool paced, bool ticking, clock::time_point next_tick)
+    {
+        // ticking paced loop composes on ticks only, appended frames don't matter in between
+        const bool on_frame = !paced || !ticking;
+        if (on_frame) {
+            m_sleeping = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
 
-            double currtime = (av_gettime() / 1000.0);
+        bool has_deadline = ticking;
+        clock::time_point deadline = next_tick;
+        int64_t pts;
+        if (on_frame && earliest_queued_pts(pts)) {
+            deadline = clock::now() + std::chrono::milliseconds(pts - av_gettime() / 1000);
+            if (!paced || deadline <= clock::now()) {
+                m_sleeping = false;
+                return;
+            }
+            has_deadline = true;
+        }
 
-            LOGD("fetch frame top_frame->pts " << pts << " currtime " << (int64_t)currtime << " diff " << (pts-(int64_t)currtime));
-            
-            if (pts > currtime && (pts-(int64_t)currtime)) {
-                SDL_AddTimer(pts-(int64_t)currtime, sdl_refresh_timer, (void*)pts);
-                return false;
+        bool woken;
+        {
+            std::unique_lock<std::mutex> lock(m_wake_mx);
+            auto wanted = [this](){return m_wake || m_done;};
+            if (has_deadline) {
+                woken = m_wake_cv.wait_until(lock, deadline, wanted);
+            } else {
+                m_wake_cv.wait(lock, wanted);
+                woken = true;
             }
-            else
-                m_encoder->display_frame();
+            m_wake = false;
+        }
+        m_sleeping = false;
+
+        if (!woken)
+            m_stats.m_wakeup_late_us.record(
+                std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - deadline).count());
+        m_stats.m_cpu_us = thread_cpu_us();
+    }
+    
+    void push_output_frame()
+    {
+        AVFramePtr frame = m_output_pool->get();
+        m_presenter->copy_canvas(frame.get());
+        frame->pts = av_gettime() / 1000;
+        m_output->push_frame(frame);
+    }
+    
+    // the tile is a reference to its last frame, only the mosaic is copied as the canvas changes in place
+    void write_snapshot(int pos, const std::string& file_name, bool requested)
+    {
+        if (!m_snapshots->can_write()) {
+            if (requested)
+                LOG_CONS("snapshot dropped, over snapshot_rate or writer is busy");
+            return;
+        }
+
+        AVFramePtr frame;
+        if (pos < 0) {
+            if (!m_snapshot_pool)
+                m_snapshot_pool = create_frame_pool(AV_PIX_FMT_YUV420P,
+                    get_app_config().m_dest_wight, get_app_config().m_dest_height);
+            frame = m_snapshot_pool->get();
+            m_presenter->copy_canvas(frame.get());
         } else {
-          std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            frame = m_streams[pos]->m_last_frame;
         }
-        
-        return true;
+
+        if (!frame) {
+            if (requested)
+                LOG_CONS("stream " << pos + 1 << " has no picture yet");
+            return;
+        }
+
+        if (m_snapshots->write(frame, file_name) && requested)
+            LOG_CONS("snapshot " << file_name);
+    }
+
+    // Console requests, then one periodic thumbnail: tiles and mosaic take turns,
+    // so a round of thumbnails is spread over the interval. Thumbnails are taken
+    // on the first pass of the loop after they are due.
+    void take_snapshots()
+    {
+        if (!m_snapshot_requests.empty()) {
+            std::vector<int> requests;
+            m_snapshot_requests.pop_all(requests);
+            for (int pos : requests)
+                write_snapshot(pos, snapshot_path(pos < 0 ? "mosaic" : "stream" + std::to_string(pos + 1), true), true);
+        }
+
+        int interval = get_app_config().m_snapshot_interval;
+        auto now = clock::now();
+        if (!interval || now < m_next_thumbnail)
+            return;
+
+        const size_t count = m_streams.size() + 1;
+        bool mosaic = m_thumbnail_pos == m_streams.size();
+        write_snapshot(mosaic ? -1 : (int)m_thumbnail_pos,
+                       snapshot_path(mosaic ? "mosaic" : "stream" + std::to_string(m_thumbnail_pos + 1), false), false);
+
+        m_thumbnail_pos = (m_thumbnail_pos + 1) % count;
+        m_next_thumbnail = now + std::chrono::milliseconds(interval * 1000 / count);
     }
     
     void consume()
     {
         try
         {
-            std::shared_ptr<encoder> enc = std::make_shared<encoder>();
-            enc->init_player();
-            m_encoder = enc;
+            std::shared_ptr<presenter> pres = std::make_shared<presenter>();
+            pres->init_player();
+            m_presenter = pres;
+            if (m_output)
+                m_output_pool = create_frame_pool(AV_PIX_FMT_YUV420P,
+                    get_app_config().m_dest_wight, get_app_config().m_dest_height);
         }
         catch(std::exception& e)
         {
@@ -311,35 +608,55 @@ public:
             return;
         }
         
+        const std::chrono::microseconds period(1000000 / get_app_config().m_output_fps);
+        auto next_tick = clock::now();
+        const bool paced = get_app_config().m_paced;
+        // output needs every tick to keep constant frame rate, display needs them to handle its events
+        const bool ticking = m_output || m_presenter->has_display();
+        
         SDL_Event event;
-        bool need_next_frame = true;
         
         while(!m_done)
         {
-            if (need_next_frame)
-            {
-                need_next_frame = process_next_frame();
-            }
-            
-            if (SDL_PollEvent(&event)) {
+            bool need_display = false;
+
+            while (m_presenter->has_display() && SDL_PollEvent(&event)) {
                 switch (event.type) {
                     case SDL_QUIT:
                         set_done();
                         break;
-                    case FF_REFRESH_EVENT:
-                        m_encoder->display_frame();
-                        LOGD("show frame with pts " << (int64_t)event.user.data1);
-                        need_next_frame = true;
+                    case SDL_VIDEOEXPOSE:
+                        need_display = true;
                         break;
                 }
             }
+
+            // one present per tick whatever number of tiles changed
+            bool composed = compose_due_frames();
+            if (composed || need_display)
+                m_presenter->display_frame();
+
+            auto now = clock::now();
+            if (now >= next_tick) {
+                if (m_output)
+                    push_output_frame();
+
+                next_tick += period;
+                if (next_tick < now)
+                    next_tick = now; // late tick, don't try to catch up with burst
+            }
+
+            take_snapshots();
+
+            if (!m_done)
+                wait_for_work(paced, ticking, next_tick);
         }
     }
 };
 
-i_frame_consumer_master_ptr start_consumer_thread()
+i_frame_consumer_master_ptr start_consumer_thread(i_output_ptr output)
 {
-    auto cons = std::make_shared<frame_consumer>();
+    auto cons = std::make_shared<frame_consumer>(output);
     cons->start_thread();
     return cons;
 }
@@ -0,0 +1,120 @@
+#include "frame_pool.h"
+#include <mutex>
+#include <vector>
+#include <atomic>
+#include <stdexcept>
+
+#include "ffmpeg_afx.h"
+#include "common.h"
+
+namespace mstream
+{
+
+class frame_pool : public i_frame_pool
+        , public std::enable_shared_from_this<frame_pool>
+{
+    const int m_format;
+    const int m_width;
+    const int m_height;
+    mutable std::mutex m_mx;
+    std::vector<AVFrame*> m_free;
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+    std::atomic<size_t> m_in_use;
+    std::atomic<size_t> m_high_water;
+public:
+    frame_pool(int format, int width, int height)
+        : m_format(format)
+        , m_width(width)
+        , m_height(height)
+        , m_hits(0)
+        , m_misses(0)
+        , m_in_use(0)
+        , m_high_water(0)
+    {}
+
+    ~frame_pool()
+    {
+        for (AVFrame* frame : m_free)
+            av_frame_free(&frame);
+    }
+
+    virtual AVFramePtr get()
+    {
+        AVFrame* frame = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(m_mx);
+            if (!m_free.empty()) {
+                frame = m_free.back();
+                m_free.pop_back();
+            }
+        }
+
+        if (frame) {
+            ++m_hits;
+        } else {
+            ++m_misses;
+            frame = alloc_frame();
+        }
+
+        // an encoder may still hold a reference to the buffers of a returned frame
+        if (av_frame_make_writable(frame) < 0) {
+            av_frame_free(&frame);
+            THROW_ERR("Error allocate buffer");
+        }
+
+        frame->pts = AV_NOPTS_VALUE;
+
+        size_t in_use = ++m_in_use;
+        size_t high_water = m_high_water;
+        while (in_use > high_water && !m_high_water.compare_exchange_weak(high_water, in_use))
+            ;
+
+        // deleter keeps the pool alive while its frames are still queued somewhere
+        auto this_ptr = shared_from_this();
+        return AVFramePtr(frame, [this_ptr](AVFrame* frame){this_ptr->release(frame);});
+    }
+
+    virtual frame_pool_stats stats() const
+    {
+        frame_pool_stats st;
+        st.m_hits = m_hits;
+        st.m_misses = m_misses;
+        st.m_in_use = m_in_use;
+        st.m_high_water = m_high_water;
+        return st;
+    }
+
+private:
+    AVFrame* alloc_frame()
+    {
+        AVFrame* frame = av_frame_alloc();
+        if (!frame)
+            THROW_ERR("Error frame allocate");
+
+        frame->format = m_format;
+        frame->width  = m_width;
+        frame->height = m_height;
+
+        if (av_frame_get_buffer(frame, 32) < 0) {
+            av_frame_free(&frame);
+            THROW_ERR("Error allocate buffer");
+        }
+
+        return frame;
+    }
+
+    void release(AVFrame* frame)
+    {
+        std::unique_lock<std::mutex> lock(m_mx);
+        m_free.push_back(frame);
+        --m_in_use;
+    }
+};
+
+i_frame_pool_ptr create_frame_pool(int format, int width, int height)
+{
+    return std::make_shared<frame_pool>(format, width, height);
+}
+
+}
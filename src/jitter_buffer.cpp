@@ -0,0 +1,91 @@
+#include "jitter_buffer.h"
+#include <cmath>
+#include <algorithm>
+
+#include "common.h"
+
+namespace mstream
+{
+
+namespace {
+
+// depth covers this many jitter estimates
+const double g_jitter_factor = 3;
+// depth follows target slowly, so the change is not visible
+const double g_adjust_step_ms = 1;
+
+}
+
+double jitter_buffer::present_time(double media_ms, double arrival_ms, double frame_interval_ms)
+{
+    const app_config& cfg = get_app_config();
+    double transit = arrival_ms - media_ms;
+
+    if (!m_started) {
+        m_started = true;
+        m_delay = cfg.m_jitter_min_ms;
+        m_offset = transit + m_delay;
+    }
+    else
+    if (m_restart || m_last_media - media_ms > cfg.m_discontinuity_ms
+        // source clock stepped forward, frames would wait for the whole gap; a gap of skipped frames
+        // arrives as late as it is long, at most the buffer ahead
+        || (media_ms - m_last_media) - (arrival_ms - m_last_arrival) > cfg.m_discontinuity_ms + cfg.m_jitter_max_ms) {
+        LOG("timestamp discontinuity " << m_last_media << " -> " << media_ms);
+        m_restart = false;
+        ++m_discontinuities;
+        m_offset = m_last_present + frame_interval_ms - media_ms;
+        m_prev_transit = transit;
+        m_last_media = media_ms;
+        m_last_present = media_ms + m_offset;
+        m_last_arrival = arrival_ms;
+        return m_last_present;
+    }
+    else {
+        m_jitter += (std::fabs(transit - m_prev_transit) - m_jitter) / 16;
+    }
+    m_prev_transit = transit;
+
+    double target = std::min(std::max(g_jitter_factor * m_jitter, cfg.m_jitter_min_ms), cfg.m_jitter_max_ms);
+    double slack = m_offset - transit;  // time the frame will wait in queue
+
+    if (slack < 0) {
+        // late arrival, grow at once to cover it
+        double grow = std::min(-slack + frame_interval_ms, cfg.m_jitter_max_ms - m_delay);
+        if (grow > 0) {
+            m_delay += grow;
+            m_offset += grow;
+        }
+    }
+    else
+    if (m_delay < target) {
+        double grow = std::min(target - m_delay, g_adjust_step_ms);
+        m_delay += grow;
+        m_offset += grow;
+    }
+    else
+    if (m_delay > target && slack > target) {
+        double shrink = std::min(std::min(m_delay - target, slack - target), g_adjust_step_ms);
+        m_delay -= shrink;
+        m_offset -= shrink;
+    }
+
+    m_last_media = media_ms;
+    m_last_present = media_ms + m_offset;
+    m_last_arrival = arrival_ms;
+    return m_last_present;
+}
+
+void jitter_buffer::rebase(double media_ms, double present_ms)
+{
+    m_offset = present_ms - media_ms;
+    m_last_media = media_ms;
+    m_last_present = present_ms;
+}
+
+double jitter_buffer::next_media(double frame_interval_ms) const
+{
+    return m_started ? m_last_media + frame_interval_ms : 0;
+}
+
+}
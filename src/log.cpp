@@ -0,0 +1,353 @@
+#include "common.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+#include "ffmpeg_afx.h"
+
+void av_log_ssream_callback(void *avcl, int level, const char *fmt, va_list vl)
+{
+    int print_prefix = 1;
+    char line[1024];
+
+    if (level >= 0)
+        level &= 0xff;
+
+    if (level > av_log_get_level())
+        return;
+
+    mstream::log_level our_level = level <= AV_LOG_ERROR ? mstream::log_level::error
+                                 : level <= AV_LOG_INFO ? mstream::log_level::info
+                                 : mstream::log_level::debug;
+    if (!mstream::log_enabled(our_level))
+        return;
+
+    av_log_format_line(avcl, level, fmt, vl, line, sizeof(line), &print_prefix);
+    mstream::trace_log(line);
+}
+
+namespace mstream
+{
+
+std::atomic<int> g_log_level((int)log_level::info);
+
+namespace
+{
+
+struct record_header
+{
+    int64_t m_time;     // ms
+    uint32_t m_size;    // text bytes following the header
+};
+
+// Byte ring of one thread: the thread writes records, the log writer reads them.
+// Nothing is ever waited for, a record that doesn't fit is counted and dropped.
+class log_ring
+{
+    std::vector<char> m_buf;
+    char m_pad0[64];
+    std::atomic<size_t> m_head;     // log writer
+    char m_pad1[64];
+    std::atomic<size_t> m_tail;     // owner thread
+    char m_pad2[64];
+    std::mutex m_name_mx;
+    std::string m_name;
+public:
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<bool> m_closed;     // owner thread exited
+
+    log_ring(size_t size, const std::string& name)
+        : m_buf(size)
+        , m_head(0)
+        , m_tail(0)
+        , m_name(name)
+        , m_dropped(0)
+        , m_closed(false)
+    {}
+
+    bool write(int64_t time, const char* text, size_t size)
+    {
+        record_header header = {time, (uint32_t)size};
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_acquire);
+        if (m_buf.size() - (tail - head) < sizeof(header) + size) {
+            ++m_dropped;
+            return false;
+        }
+
+        copy_in(tail, (const char*)&header, sizeof(header));
+        copy_in(tail + sizeof(header), text, size);
+        m_tail.store(tail + sizeof(header) + size, std::memory_order_release);
+        return true;
+    }
+
+    // false if ring is empty
+    bool read(int64_t& time, std::string& text)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+            return false;
+
+        record_header header;
+        copy_out(head, (char*)&header, sizeof(header));
+        time = header.m_time;
+        text.resize(header.m_size);
+        if (header.m_size)
+            copy_out(head + sizeof(header), &text[0], header.m_size);
+        m_head.store(head + sizeof(header) + header.m_size, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const
+    {
+        return m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const
+    {
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+    }
+
+    void set_name(const std::string& name)
+    {
+        std::unique_lock<std::mutex> lock(m_name_mx);
+        m_name = name;
+    }
+
+    std::string name()
+    {
+        std::unique_lock<std::mutex> lock(m_name_mx);
+        return m_name;
+    }
+
+private:
+    void copy_in(size_t pos, const char* src, size_t size)
+    {
+        size_t offset = pos % m_buf.size();
+        size_t first = std::min(size, m_buf.size() - offset);
+        memcpy(&m_buf[offset], src, first);
+        memcpy(&m_buf[0], src + first, size - first);
+    }
+
+    void copy_out(size_t pos, char* dst, size_t size) const
+    {
+        size_t offset = pos % m_buf.size();
+        size_t first = std::min(size, m_buf.size() - offset);
+        memcpy(dst, &m_buf[offset], first);
+        memcpy(dst + first, &m_buf[0], size - first);
+    }
+};
+
+typedef std::shared_ptr<log_ring> log_ring_ptr;
+
+const size_t ring_size = 256 * 1024;
+const size_t max_record = ring_size / 4;
+
+// Drains thread rings into the file in batches, records of a batch are ordered by time.
+class log_writer
+{
+    std::mutex m_mx;
+    std::condition_variable m_cv;
+    std::vector<log_ring_ptr> m_rings;  // guarded by m_mx
+    bool m_stop = false;
+    std::thread m_thread;
+    std::ofstream m_file;
+    std::mutex m_console_mx;
+
+    struct line
+    {
+        int64_t m_time;
+        const std::string* m_name;
+        std::string m_text;
+    };
+public:
+    ~log_writer()
+    {
+        shutdown();
+    }
+
+    void start(const std::string& file_name)
+    {
+        m_file.open(file_name, std::ofstream::out|std::ofstream::app);
+        m_thread = std::thread([this](){run();});
+    }
+
+    void add_ring(const log_ring_ptr& ring)
+    {
+        std::unique_lock<std::mutex> lock(m_mx);
+        m_rings.push_back(ring);
+    }
+
+    // ring of the calling thread fills up, let the writer drain it earlier
+    void wake()
+    {
+        m_cv.notify_one();
+    }
+
+    void console(int64_t time, const std::string& name, const std::string& str)
+    {
+        std::unique_lock<std::mutex> lock(m_console_mx);
+        std::cout << time << " thrd:" << name << " " << str << std::endl;
+    }
+
+    void shutdown()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mx);
+            m_stop = true;
+        }
+        m_cv.notify_one();
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_mx);
+        while (true) {
+            m_cv.wait_for(lock, std::chrono::milliseconds(50));
+            bool stop = m_stop;
+            std::vector<log_ring_ptr> rings = m_rings;
+            lock.unlock();
+
+            drain(rings);
+
+            lock.lock();
+            // ring of exited thread goes away once it is empty
+            m_rings.erase(std::remove_if(m_rings.begin(), m_rings.end(),
+                [](const log_ring_ptr& ring){return ring->m_closed && ring->empty();}), m_rings.end());
+            if (stop)
+                break;
+        }
+    }
+
+    void drain(const std::vector<log_ring_ptr>& rings)
+    {
+        std::vector<std::string> names(rings.size());
+        std::vector<line> lines;
+        for (size_t i = 0; i < rings.size(); ++i) {
+            names[i] = rings[i]->name();
+            line l;
+            l.m_name = &names[i];
+            while (rings[i]->read(l.m_time, l.m_text))
+                lines.push_back(l);
+
+            uint64_t dropped = rings[i]->m_dropped.exchange(0);
+            if (dropped) {
+                l.m_time = av_gettime() / 1000;
+                l.m_text = std::to_string(dropped) + " log records dropped";
+                lines.push_back(l);
+            }
+        }
+
+        if (lines.empty())
+            return;
+
+        std::stable_sort(lines.begin(), lines.end(),
+            [](const line& a, const line& b){return a.m_time < b.m_time;});
+
+        for (const line& l : lines)
+            m_file << l.m_time << " thrd:" << *l.m_name << " " << l.m_text << '\n';
+        m_file.flush();
+    }
+};
+
+log_writer g_writer;
+
+// ring and name of the calling thread
+struct thread_log
+{
+    log_ring_ptr m_ring;
+    std::string m_name;
+
+    ~thread_log()
+    {
+        if (m_ring)
+            m_ring->m_closed = true;
+    }
+
+    const std::string& name()
+    {
+        if (m_name.empty()) {
+            std::ostringstream id;
+            id << std::this_thread::get_id();
+            m_name = id.str();
+        }
+        return m_name;
+    }
+
+    log_ring& ring()
+    {
+        if (!m_ring) {
+            m_ring = std::make_shared<log_ring>(ring_size, name());
+            g_writer.add_ring(m_ring);
+        }
+        return *m_ring;
+    }
+};
+
+thread_local thread_log t_log;
+
+}
+
+void initialize_log()
+{
+    g_writer.start("mstream.log");
+    av_log_set_callback(av_log_ssream_callback);
+}
+
+void shutdown_log()
+{
+    g_writer.shutdown();
+}
+
+void set_log_level(log_level level)
+{
+    g_log_level = (int)level;
+}
+
+bool parse_log_level(const std::string& name, log_level& level)
+{
+    if (name == "error")
+        level = log_level::error;
+    else
+    if (name == "info")
+        level = log_level::info;
+    else
+    if (name == "debug")
+        level = log_level::debug;
+    else
+        return false;
+    return true;
+}
+
+void register_current_thread(const std::string& name)
+{
+    t_log.m_name = name;
+    if (t_log.m_ring)
+        t_log.m_ring->set_name(name);
+}
+
+void trace_log(const std::string& str, bool copy_to_console)
+{
+    int64_t currtime = av_gettime() / 1000;
+
+    if (copy_to_console)
+        g_writer.console(currtime, t_log.name(), str);
+
+    log_ring& ring = t_log.ring();
+    size_t size = std::min(str.size(), max_record);
+    if (!ring.write(currtime, str.data(), size) || ring.size() > ring_size / 2)
+        g_writer.wake();
+}
+
+}
@@ -0,0 +1,323 @@
+#include "output.h"
+#include "ffmpeg_afx.h"
+#include "common.h"
+#include "spsc_ring.h"
+#include "frame_pool.h"
+#include "plane_ops.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+namespace mstream
+{
+
+class output : public i_output
+{
+    spsc_ring<AVFramePtr> m_frames;
+    std::mutex m_mx;
+    std::condition_variable m_cv;
+    bool m_stop = false;            // guarded by m_mx
+    std::atomic<bool> m_failed;
+    std::thread m_thread;
+
+    // output thread only
+    AVFormatContext* m_fmt = nullptr;
+    AVCodecContext* m_enc = nullptr;
+    AVStream* m_stream = nullptr;
+    AVPacket* m_pkt = nullptr;
+    bool m_header_written = false;
+    i_frame_pool_ptr m_nv12_pool;   // encoder takes only NV12, canvas is converted
+    int64_t m_last_pts = AV_NOPTS_VALUE;
+
+    std::atomic<double> m_fps;
+    std::atomic<uint64_t> m_encoded;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<uint64_t> m_bytes;
+public:
+    output()
+        : m_frames(get_app_config().m_output_queue)
+        , m_failed(false)
+        , m_fps(0)
+        , m_encoded(0)
+        , m_dropped(0)
+        , m_bytes(0)
+    {}
+
+    ~output()
+    {
+        stop();
+        LOG("~output " << this);
+    }
+
+    void start_thread()
+    {
+        m_thread = std::thread([this](){
+            register_current_thread("Output");
+
+            LOG("Thread output started " << std::this_thread::get_id());
+            try {
+                open();
+                run();
+            }
+            catch(std::exception& e) {
+                m_failed = true;
+                LOG_CONS("output failed: " << e.what());
+            }
+            close();
+
+            LOG("Thread output stopped " << std::this_thread::get_id());
+        });
+    }
+
+    virtual bool push_frame(AVFramePtr frame)
+    {
+        if (m_failed || !m_frames.push(frame)) {
+            ++m_dropped;
+            return false;
+        }
+
+        // empty critical section orders the push before the check in the waiting thread
+        {
+            std::lock_guard<std::mutex> lock(m_mx);
+        }
+        m_cv.notify_one();
+        return true;
+    }
+
+    virtual output_stats stats() const
+    {
+        output_stats st;
+        st.m_fps = m_fps;
+        st.m_encoded = m_encoded;
+        st.m_dropped = m_dropped;
+        st.m_bytes = m_bytes;
+        st.m_queue_depth = m_frames.size();
+        st.m_queue_capacity = m_frames.capacity();
+        return st;
+    }
+
+    virtual void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mx);
+            m_stop = true;
+        }
+        m_cv.notify_one();
+
+        if (m_thread.joinable() && m_thread.get_id() != std::this_thread::get_id())
+            m_thread.join();
+    }
+
+private:
+    void open()
+    {
+        const app_config& cfg = get_app_config();
+        const std::string& url = cfg.m_output_url;
+
+        const char* format = cfg.m_output_format.empty() ? nullptr : cfg.m_output_format.c_str();
+        if (avformat_alloc_output_context2(&m_fmt, nullptr, format, url.c_str()) < 0 || !m_fmt)
+            THROW_ERR("Could not create muxer for " << url);
+
+        const AVCodec* codec = avcodec_find_encoder_by_name(cfg.m_output_codec.c_str());
+        if (!codec) {
+            LOG_CONS("encoder " << cfg.m_output_codec << " not found, mpeg4 is used");
+            codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+        }
+        if (!codec)
+            THROW_ERR("No video encoder");
+
+        AVPixelFormat pix_fmt = AV_PIX_FMT_YUV420P;
+        if (codec->pix_fmts) {
+            bool has_yuv420p = false, has_nv12 = false;
+            for (const AVPixelFormat* fmt = codec->pix_fmts; *fmt != AV_PIX_FMT_NONE; ++fmt) {
+                has_yuv420p = has_yuv420p || *fmt == AV_PIX_FMT_YUV420P;
+                has_nv12 = has_nv12 || *fmt == AV_PIX_FMT_NV12;
+            }
+            if (!has_yuv420p && !has_nv12)
+                THROW_ERR("Encoder " << codec->name << " supports neither yuv420p nor nv12");
+            if (!has_yuv420p)
+                pix_fmt = AV_PIX_FMT_NV12;
+        }
+
+        m_enc = avcodec_alloc_context3(codec);
+        if (!m_enc)
+            THROW_ERR("Could not allocate encoder context");
+
+        m_enc->width = cfg.m_dest_wight;
+        m_enc->height = cfg.m_dest_height;
+        m_enc->pix_fmt = pix_fmt;
+        if (pix_fmt == AV_PIX_FMT_NV12)
+            m_nv12_pool = create_frame_pool(AV_PIX_FMT_NV12, cfg.m_dest_wight, cfg.m_dest_height);
+        m_enc->time_base = AVRational{1, cfg.m_output_fps};
+        m_enc->framerate = AVRational{cfg.m_output_fps, 1};
+        m_enc->gop_size = cfg.m_output_fps * 2;
+        m_enc->max_b_frames = 0;    // live wall, no reordering delay
+        m_enc->bit_rate = cfg.m_output_bitrate;
+        m_enc->thread_count = 0;
+        if (m_fmt->oformat->flags & AVFMT_GLOBALHEADER)
+            m_enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+        if (!strcmp(codec->name, "libx264")) {
+            av_opt_set(m_enc->priv_data, "preset", "veryfast", 0);
+            av_opt_set(m_enc->priv_data, "tune", "zerolatency", 0);
+        }
+
+        if (avcodec_open2(m_enc, codec, nullptr) < 0)
+            THROW_ERR("Could not open encoder " << codec->name);
+
+        m_stream = avformat_new_stream(m_fmt, nullptr);
+        if (!m_stream)
+            THROW_ERR("Could not create output stream");
+
+        if (avcodec_parameters_from_context(m_stream->codecpar, m_enc) < 0)
+            THROW_ERR("Could not copy encoder parameters");
+        m_stream->time_base = m_enc->time_base;
+
+        if (!(m_fmt->oformat->flags & AVFMT_NOFILE)) {
+            if (avio_open(&m_fmt->pb, url.c_str(), AVIO_FLAG_WRITE) < 0)
+                THROW_ERR("Could not open " << url);
+        }
+
+        AVDictionary* opts = nullptr;
+        AutoFree free_opts([&opts](){av_dict_free(&opts);});
+        for (const auto& opt : cfg.m_output_options)
+            av_dict_set(&opts, opt.first.c_str(), opt.second.c_str(), 0);
+
+        if (avformat_write_header(m_fmt, &opts) < 0)
+            THROW_ERR("Could not write header to " << url);
+        m_header_written = true;
+
+        AVDictionaryEntry* unused = nullptr;
+        while ((unused = av_dict_get(opts, "", unused, AV_DICT_IGNORE_SUFFIX)))
+            LOG_CONS("output option " << unused->key << " is not used");
+
+        m_pkt = av_packet_alloc();
+        if (!m_pkt)
+            THROW_ERR("Could not allocate packet");
+
+        LOG_CONS("output " << url << " " << m_fmt->oformat->name << " " << codec->name
+            << " " << m_enc->width << "x" << m_enc->height << "@" << cfg.m_output_fps);
+    }
+
+    void run()
+    {
+        auto window_start = std::chrono::steady_clock::now();
+        uint64_t window_frames = 0;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m_mx);
+                m_cv.wait_for(lock, std::chrono::seconds(1), [this](){return m_stop || m_frames.front();});
+            }
+
+            // queued frames are encoded before stop
+            AVFramePtr* front = m_frames.front();
+            if (front) {
+                AVFramePtr frame = *front;
+                m_frames.pop();
+                encode(frame);
+                ++window_frames;
+            }
+            else {
+                std::lock_guard<std::mutex> lock(m_mx);
+                if (m_stop)
+                    break;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            std::chrono::duration<double> elapsed = now - window_start;
+            if (elapsed.count() >= 1) {
+                m_fps = window_frames / elapsed.count();
+                window_frames = 0;
+                window_start = now;
+            }
+        }
+
+        // end of stream drains frames buffered in the encoder
+        if (avcodec_send_frame(m_enc, nullptr) >= 0)
+            write_packets();
+    }
+
+    AVFramePtr to_nv12(const AVFramePtr& frame)
+    {
+        AVFramePtr nv12 = m_nv12_pool->get();
+        const plane_kernels& ops = plane_ops();
+        ops.copy(nv12->data[0], nv12->linesize[0], frame->data[0], frame->linesize[0], frame->width, frame->height);
+        ops.interleave_uv(nv12->data[1], nv12->linesize[1],
+                          frame->data[1], frame->linesize[1], frame->data[2], frame->linesize[2],
+                          (frame->width + 1) / 2, (frame->height + 1) / 2);
+        nv12->pts = frame->pts;
+        return nv12;
+    }
+
+    void encode(AVFramePtr frame)
+    {
+        if (m_nv12_pool)
+            frame = to_nv12(frame);
+
+        // frame pts is wall clock in ms, encoder counts output ticks
+        int64_t pts = av_rescale_q(frame->pts, AVRational{1, 1000}, m_enc->time_base);
+        if (m_last_pts != AV_NOPTS_VALUE && pts <= m_last_pts)
+            pts = m_last_pts + 1;
+        m_last_pts = pts;
+        frame->pts = pts;
+
+        if (avcodec_send_frame(m_enc, frame.get()) < 0)
+            THROW_ERR("Error sending a frame to encoder");
+
+        write_packets();
+        ++m_encoded;
+    }
+
+    void write_packets()
+    {
+        while (true) {
+            int ret = avcodec_receive_packet(m_enc, m_pkt);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+                return;
+            if (ret < 0)
+                THROW_ERR("Error during encoding");
+
+            av_packet_rescale_ts(m_pkt, m_enc->time_base, m_stream->time_base);
+            m_pkt->stream_index = m_stream->index;
+            m_bytes += m_pkt->size;
+
+            // muxer takes the packet reference
+            if (av_interleaved_write_frame(m_fmt, m_pkt) < 0)
+                THROW_ERR("Error writing output packet");
+        }
+    }
+
+    void close()
+    {
+        if (m_header_written)
+            av_write_trailer(m_fmt);
+
+        av_packet_free(&m_pkt);
+        avcodec_free_context(&m_enc);
+
+        if (m_fmt) {
+            if (!(m_fmt->oformat->flags & AVFMT_NOFILE))
+                avio_closep(&m_fmt->pb);
+            avformat_free_context(m_fmt);
+            m_fmt = nullptr;
+        }
+    }
+};
+
+i_output_ptr start_output_thread()
+{
+    if (get_app_config().m_output_url.empty())
+        return i_output_ptr();
+
+    auto out = std::make_shared<output>();
+    out->start_thread();
+    return out;
+}
+
+}
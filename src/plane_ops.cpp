@@ -0,0 +1,340 @@
+#include "plane_ops.h"
+#include "common.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MSTREAM_X86 1
+#endif
+
+namespace mstream
+{
+
+namespace
+{
+
+// libc memset/memcpy are already dispatched by cpu, kernels only drop per row overhead
+void fill_rows(uint8_t* dst, int linesize, int width, int height, uint8_t value)
+{
+    if (linesize == width) {
+        memset(dst, value, (size_t)width * height);
+        return;
+    }
+    for (int y = 0; y < height; ++y)
+        memset(dst + (ptrdiff_t)y * linesize, value, width);
+}
+
+void copy_rows(uint8_t* dst, int dst_linesize, const uint8_t* src, int src_linesize, int width, int height)
+{
+    if (dst_linesize == width && src_linesize == width) {
+        memcpy(dst, src, (size_t)width * height);
+        return;
+    }
+    for (int y = 0; y < height; ++y)
+        memcpy(dst + (ptrdiff_t)y * dst_linesize, src + (ptrdiff_t)y * src_linesize, width);
+}
+
+inline void interleave_row_c(uint8_t* uv, const uint8_t* u, const uint8_t* v, int from, int width)
+{
+    for (int x = from; x < width; ++x) {
+        uv[2 * x] = u[x];
+        uv[2 * x + 1] = v[x];
+    }
+}
+
+inline void deinterleave_row_c(uint8_t* u, uint8_t* v, const uint8_t* uv, int from, int width)
+{
+    for (int x = from; x < width; ++x) {
+        u[x] = uv[2 * x];
+        v[x] = uv[2 * x + 1];
+    }
+}
+
+void interleave_uv_c(uint8_t* uv, int uv_linesize, const uint8_t* u, int u_linesize,
+                     const uint8_t* v, int v_linesize, int width, int height)
+{
+    for (int y = 0; y < height; ++y)
+        interleave_row_c(uv + (ptrdiff_t)y * uv_linesize, u + (ptrdiff_t)y * u_linesize,
+                         v + (ptrdiff_t)y * v_linesize, 0, width);
+}
+
+void deinterleave_uv_c(uint8_t* u, int u_linesize, uint8_t* v, int v_linesize,
+                       const uint8_t* uv, int uv_linesize, int width, int height)
+{
+    for (int y = 0; y < height; ++y)
+        deinterleave_row_c(u + (ptrdiff_t)y * u_linesize, v + (ptrdiff_t)y * v_linesize,
+                           uv + (ptrdiff_t)y * uv_linesize, 0, width);
+}
+
+const plane_kernels g_scalar = {"scalar", fill_rows, copy_rows, interleave_uv_c, deinterleave_uv_c};
+
+#ifdef MSTREAM_X86
+
+__attribute__((target("sse2")))
+void interleave_uv_sse2(uint8_t* uv, int uv_linesize, const uint8_t* u, int u_linesize,
+                        const uint8_t* v, int v_linesize, int width, int height)
+{
+    for (int y = 0; y < height; ++y) {
+        uint8_t* d = uv + (ptrdiff_t)y * uv_linesize;
+        const uint8_t* su = u + (ptrdiff_t)y * u_linesize;
+        const uint8_t* sv = v + (ptrdiff_t)y * v_linesize;
+        int x = 0;
+        for (; x + 16 <= width; x += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(su + x));
+            __m128i b = _mm_loadu_si128((const __m128i*)(sv + x));
+            _mm_storeu_si128((__m128i*)(d + 2 * x), _mm_unpacklo_epi8(a, b));
+            _mm_storeu_si128((__m128i*)(d + 2 * x + 16), _mm_unpackhi_epi8(a, b));
+        }
+        interleave_row_c(d, su, sv, x, width);
+    }
+}
+
+__attribute__((target("sse2")))
+void deinterleave_uv_sse2(uint8_t* u, int u_linesize, uint8_t* v, int v_linesize,
+                          const uint8_t* uv, int uv_linesize, int width, int height)
+{
+    const __m128i low = _mm_set1_epi16(0x00ff);
+    for (int y = 0; y < height; ++y) {
+        uint8_t* du = u + (ptrdiff_t)y * u_linesize;
+        uint8_t* dv = v + (ptrdiff_t)y * v_linesize;
+        const uint8_t* s = uv + (ptrdiff_t)y * uv_linesize;
+        int x = 0;
+        for (; x + 16 <= width; x += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(s + 2 * x));
+            __m128i b = _mm_loadu_si128((const __m128i*)(s + 2 * x + 16));
+            _mm_storeu_si128((__m128i*)(du + x), _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low)));
+            _mm_storeu_si128((__m128i*)(dv + x), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+        }
+        deinterleave_row_c(du, dv, s, x, width);
+    }
+}
+
+__attribute__((target("avx2")))
+void interleave_uv_avx2(uint8_t* uv, int uv_linesize, const uint8_t* u, int u_linesize,
+                        const uint8_t* v, int v_linesize, int width, int height)
+{
+    for (int y = 0; y < height; ++y) {
+        uint8_t* d = uv + (ptrdiff_t)y * uv_linesize;
+        const uint8_t* su = u + (ptrdiff_t)y * u_linesize;
+        const uint8_t* sv = v + (ptrdiff_t)y * v_linesize;
+        int x = 0;
+        for (; x + 32 <= width; x += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(su + x));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(sv + x));
+            // unpack works inside 128 bit lanes, lanes are put back in order
+            __m256i lo = _mm256_unpacklo_epi8(a, b);
+            __m256i hi = _mm256_unpackhi_epi8(a, b);
+            _mm256_storeu_si256((__m256i*)(d + 2 * x), _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i*)(d + 2 * x + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+        interleave_row_c(d, su, sv, x, width);
+    }
+}
+
+__attribute__((target("avx2")))
+void deinterleave_uv_avx2(uint8_t* u, int u_linesize, uint8_t* v, int v_linesize,
+                          const uint8_t* uv, int uv_linesize, int width, int height)
+{
+    const __m256i low = _mm256_set1_epi16(0x00ff);
+    for (int y = 0; y < height; ++y) {
+        uint8_t* du = u + (ptrdiff_t)y * u_linesize;
+        uint8_t* dv = v + (ptrdiff_t)y * v_linesize;
+        const uint8_t* s = uv + (ptrdiff_t)y * uv_linesize;
+        int x = 0;
+        for (; x + 32 <= width; x += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(s + 2 * x));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(s + 2 * x + 32));
+            __m256i pu = _mm256_packus_epi16(_mm256_and_si256(a, low), _mm256_and_si256(b, low));
+            __m256i pv = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+            _mm256_storeu_si256((__m256i*)(du + x), _mm256_permute4x64_epi64(pu, 0xd8));
+            _mm256_storeu_si256((__m256i*)(dv + x), _mm256_permute4x64_epi64(pv, 0xd8));
+        }
+        deinterleave_row_c(du, dv, s, x, width);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void interleave_uv_avx512(uint8_t* uv, int uv_linesize, const uint8_t* u, int u_linesize,
+                          const uint8_t* v, int v_linesize, int width, int height)
+{
+    const __m512i first = _mm512_set_epi64(11, 10, 3, 2, 9, 8, 1, 0);
+    const __m512i second = _mm512_set_epi64(15, 14, 7, 6, 13, 12, 5, 4);
+    for (int y = 0; y < height; ++y) {
+        uint8_t* d = uv + (ptrdiff_t)y * uv_linesize;
+        const uint8_t* su = u + (ptrdiff_t)y * u_linesize;
+        const uint8_t* sv = v + (ptrdiff_t)y * v_linesize;
+        int x = 0;
+        for (; x + 64 <= width; x += 64) {
+            __m512i a = _mm512_loadu_si512((const void*)(su + x));
+            __m512i b = _mm512_loadu_si512((const void*)(sv + x));
+            __m512i lo = _mm512_unpacklo_epi8(a, b);
+            __m512i hi = _mm512_unpackhi_epi8(a, b);
+            _mm512_storeu_si512((void*)(d + 2 * x), _mm512_permutex2var_epi64(lo, first, hi));
+            _mm512_storeu_si512((void*)(d + 2 * x + 64), _mm512_permutex2var_epi64(lo, second, hi));
+        }
+        interleave_row_c(d, su, sv, x, width);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void deinterleave_uv_avx512(uint8_t* u, int u_linesize, uint8_t* v, int v_linesize,
+                            const uint8_t* uv, int uv_linesize, int width, int height)
+{
+    const __m512i low = _mm512_set1_epi16(0x00ff);
+    const __m512i order = _mm512_set_epi64(7, 5, 3, 1, 6, 4, 2, 0);
+    for (int y = 0; y < height; ++y) {
+        uint8_t* du = u + (ptrdiff_t)y * u_linesize;
+        uint8_t* dv = v + (ptrdiff_t)y * v_linesize;
+        const uint8_t* s = uv + (ptrdiff_t)y * uv_linesize;
+        int x = 0;
+        for (; x + 64 <= width; x += 64) {
+            __m512i a = _mm512_loadu_si512((const void*)(s + 2 * x));
+            __m512i b = _mm512_loadu_si512((const void*)(s + 2 * x + 64));
+            __m512i pu = _mm512_packus_epi16(_mm512_and_si512(a, low), _mm512_and_si512(b, low));
+            __m512i pv = _mm512_packus_epi16(_mm512_srli_epi16(a, 8), _mm512_srli_epi16(b, 8));
+            _mm512_storeu_si512((void*)(du + x), _mm512_permutexvar_epi64(order, pu));
+            _mm512_storeu_si512((void*)(dv + x), _mm512_permutexvar_epi64(order, pv));
+        }
+        deinterleave_row_c(du, dv, s, x, width);
+    }
+}
+
+const plane_kernels g_sse2 = {"sse2", fill_rows, copy_rows, interleave_uv_sse2, deinterleave_uv_sse2};
+const plane_kernels g_avx2 = {"avx2", fill_rows, copy_rows, interleave_uv_avx2, deinterleave_uv_avx2};
+const plane_kernels g_avx512 = {"avx512", fill_rows, copy_rows, interleave_uv_avx512, deinterleave_uv_avx512};
+
+#endif
+
+std::vector<const plane_kernels*> detect_plane_ops()
+{
+    std::vector<const plane_kernels*> ops;
+    ops.push_back(&g_scalar);
+#ifdef MSTREAM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        ops.push_back(&g_sse2);
+    if (__builtin_cpu_supports("avx2"))
+        ops.push_back(&g_avx2);
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        ops.push_back(&g_avx512);
+#endif
+    return ops;
+}
+
+struct test_plane
+{
+    int m_width;
+    int m_height;
+    int m_linesize;
+    std::vector<uint8_t> m_data;
+
+    test_plane(int width, int height, int pad)
+        : m_width(width)
+        , m_height(height)
+        , m_linesize(width + pad)
+        , m_data((size_t)(width + pad) * height)
+    {}
+
+    void randomize()
+    {
+        for (auto& b : m_data)
+            b = (uint8_t)rand();
+    }
+};
+
+bool check_variant(const plane_kernels& ops, int width, int height, int pad)
+{
+    const plane_kernels& ref = g_scalar;
+    bool ok = true;
+    auto expect = [&](bool same, const char* kernel) {
+        if (!same) {
+            LOG_CONS("plane kernel " << ops.m_name << " " << kernel << " differs from scalar on "
+                     << width << "x" << height << " pad " << pad);
+            ok = false;
+        }
+    };
+
+    test_plane u(width, height, pad), v(width, height + 1, pad + 3), uv(width * 2, height, pad * 2 + 1);
+    u.randomize();
+    v.randomize();
+    test_plane a = uv, b = uv;
+    ref.interleave_uv(a.m_data.data(), a.m_linesize, u.m_data.data(), u.m_linesize,
+                      v.m_data.data(), v.m_linesize, width, height);
+    ops.interleave_uv(b.m_data.data(), b.m_linesize, u.m_data.data(), u.m_linesize,
+                      v.m_data.data(), v.m_linesize, width, height);
+    expect(a.m_data == b.m_data, "interleave_uv");
+
+    uv.randomize();
+    test_plane ua = u, va = v, ub = u, vb = v;
+    ref.deinterleave_uv(ua.m_data.data(), ua.m_linesize, va.m_data.data(), va.m_linesize,
+                        uv.m_data.data(), uv.m_linesize, width, height);
+    ops.deinterleave_uv(ub.m_data.data(), ub.m_linesize, vb.m_data.data(), vb.m_linesize,
+                        uv.m_data.data(), uv.m_linesize, width, height);
+    expect(ua.m_data == ub.m_data && va.m_data == vb.m_data, "deinterleave_uv");
+
+    test_plane fa = u, fb = u;
+    ref.fill(fa.m_data.data(), fa.m_linesize, width, height, 0x5a);
+    ops.fill(fb.m_data.data(), fb.m_linesize, width, height, 0x5a);
+    expect(fa.m_data == fb.m_data, "fill");
+
+    test_plane ca = v, cb = v;
+    ref.copy(ca.m_data.data(), ca.m_linesize, u.m_data.data(), u.m_linesize, width, height);
+    ops.copy(cb.m_data.data(), cb.m_linesize, u.m_data.data(), u.m_linesize, width, height);
+    expect(ca.m_data == cb.m_data, "copy");
+
+    return ok;
+}
+
+}
+
+const plane_kernels& plane_ops()
+{
+    static const plane_kernels* s_best = detect_plane_ops().back();
+    return *s_best;
+}
+
+const plane_kernels& scalar_plane_ops()
+{
+    return g_scalar;
+}
+
+std::vector<const plane_kernels*> supported_plane_ops()
+{
+    return detect_plane_ops();
+}
+
+void draw_border(uint8_t* dst, int linesize, int x, int y, int width, int height, int thickness, uint8_t value)
+{
+    thickness = std::min(thickness, std::min(width, height) / 2);
+    if (thickness <= 0)
+        return;
+
+    const plane_kernels& ops = plane_ops();
+    uint8_t* origin = dst + (ptrdiff_t)y * linesize + x;
+    ops.fill(origin, linesize, width, thickness, value);
+    ops.fill(origin + (ptrdiff_t)(height - thickness) * linesize, linesize, width, thickness, value);
+    ops.fill(origin + (ptrdiff_t)thickness * linesize, linesize, thickness, height - 2 * thickness, value);
+    ops.fill(origin + (ptrdiff_t)thickness * linesize + width - thickness, linesize,
+             thickness, height - 2 * thickness, value);
+}
+
+bool check_plane_ops()
+{
+    // sizes around vector widths and their tails
+    const int widths[] = {1, 7, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129, 360, 961};
+    const int heights[] = {1, 3, 17};
+    const int pads[] = {0, 1, 13};
+
+    bool ok = true;
+    for (const plane_kernels* ops : supported_plane_ops())
+        for (int w : widths)
+            for (int h : heights)
+                for (int p : pads)
+                    ok = check_variant(*ops, w, h, p) && ok;
+    return ok;
+}
+
+}
@@ -0,0 +1,165 @@
+#include "quality_controller.h"
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "ffmpeg_afx.h"
+#include "common.h"
+
+namespace mstream
+{
+
+namespace {
+
+const int64_t g_window_us = 1000000;
+const int64_t g_restore_delay_us = 5000000;
+
+int64_t timeval_us(const timeval& tv)
+{
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+}
+
+const char* quality_level_name(int level)
+{
+    switch (level) {
+    case quality_full:              return "full";
+    case quality_skip_loop_filter:  return "skip_loop_filter";
+    case quality_skip_nonref:       return "skip_nonref";
+    case quality_lowres:            return "lowres";
+    case quality_skip_nonkey:       return "skip_nonkey";
+    default:                        return "unknown";
+    }
+}
+
+bool parse_quality_level(const std::string& name, int& level)
+{
+    for (int l = quality_full; l < quality_levels; ++l) {
+        if (name == quality_level_name(l)) {
+            level = l;
+            return true;
+        }
+    }
+    return false;
+}
+
+double process_cpu_load()
+{
+    static std::mutex mx;
+    static int64_t last_wall = 0;
+    static int64_t last_cpu = 0;
+    static std::atomic<double> load(0);
+
+    // sampled at most twice a second, other callers get the last value
+    std::unique_lock<std::mutex> lock(mx, std::try_to_lock);
+    if (!lock.owns_lock())
+        return load;
+
+    int64_t wall = av_gettime_relative();
+    if (wall - last_wall < g_window_us / 2)
+        return load;
+
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return load;
+
+    int64_t cpu = timeval_us(usage.ru_utime) + timeval_us(usage.ru_stime);
+    if (last_wall) {
+        unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        load = (double)(cpu - last_cpu) / ((wall - last_wall) * cores);
+    }
+
+    last_wall = wall;
+    last_cpu = cpu;
+    return load;
+}
+
+void quality_controller::add_frame(double lead_ms, double media_ms)
+{
+    m_min_lead_ms = m_has_frames ? std::min(m_min_lead_ms, lead_ms) : lead_ms;
+    m_media_ms += media_ms;
+    m_has_frames = true;
+}
+
+bool quality_controller::update(int64_t now_us, double min_lead_ms)
+{
+    if (m_forced >= 0) {
+        int level = m_forced == quality_lowres && !m_has_lowres ? quality_skip_nonkey : m_forced;
+        if (level == m_level)
+            return false;
+        LOG("quality " << quality_level_name(m_level) << " -> " << quality_level_name(level) << " forced");
+        m_level = level;
+        m_last_change = now_us;
+        return true;
+    }
+
+    if (!m_window_start) {
+        reset_window(now_us);
+        return false;
+    }
+
+    if (now_us - m_window_start < g_window_us)
+        return false;
+
+    // at skip_nonkey frames come a GOP apart, the window lasts up to the next one,
+    // so busy time and lead are measured against the media time it covers
+    if (m_level == quality_skip_nonkey && !m_has_frames && get_app_config().m_adaptive_quality)
+        return false;
+
+    const app_config& cfg = get_app_config();
+    if (!cfg.m_adaptive_quality) {
+        bool changed = m_level != quality_full;
+        m_level = quality_full;
+        reset_window(now_us);
+        return changed;
+    }
+
+    // share of media time spent in decoding, above 1 decoder can't keep realtime
+    double busy_ratio = m_media_ms > 0 ? m_busy_us / (m_media_ms * 1000) : (m_busy_us ? 1 : 0);
+    double cpu = process_cpu_load();
+    bool behind = !m_has_frames || m_min_lead_ms < min_lead_ms;
+
+    int level = m_level;
+    if (behind && (busy_ratio > 0.9 || cpu > 0.9)) {
+        level = step(m_level, 1);
+    }
+    else
+    if (!behind && busy_ratio < 0.6 && cpu < 0.75 && now_us - m_last_change > g_restore_delay_us) {
+        level = step(m_level, -1);
+    }
+
+    reset_window(now_us);
+
+    if (level == m_level)
+        return false;
+
+    LOG("quality " << quality_level_name(m_level) << " -> " << quality_level_name(level)
+        << " busy " << busy_ratio << " cpu " << cpu << " lead " << m_min_lead_ms);
+    m_level = level;
+    m_last_change = now_us;
+    return true;
+}
+
+int quality_controller::step(int level, int dir) const
+{
+    level = std::min(std::max(level + dir, (int)quality_full), (int)quality_levels - 1);
+    if (level == quality_lowres && !m_has_lowres)
+        level = std::min(std::max(level + dir, (int)quality_full), (int)quality_levels - 1);
+    return level;
+}
+
+void quality_controller::reset_window(int64_t now_us)
+{
+    m_window_start = now_us;
+    m_busy_us = 0;
+    m_media_ms = 0;
+    m_min_lead_ms = 0;
+    m_has_frames = false;
+}
+
+}
@@ -0,0 +1,400 @@
+#include "recorder.h"
+#include "ffmpeg_afx.h"
+#include "common.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+
+namespace mstream
+{
+
+namespace
+{
+
+const char* muxer_name(record_format format)
+{
+    switch (format) {
+    case record_format::mp4:
+        return "mp4";
+    case record_format::ts:
+        return "mpegts";
+    case record_format::mkv:
+        break;
+    }
+    return "matroska";
+}
+
+typedef std::shared_ptr<AVCodecParameters> codec_parameters_ptr;
+
+enum class record_item_type
+{
+    begin,
+    packet,
+    end,
+};
+
+struct record_item
+{
+    record_item_type m_type;
+    AVPacketPtr m_packet;
+    codec_parameters_ptr m_par;     // begin
+    AVRational m_time_base = AVRational{1, 1000};   // begin
+
+    explicit record_item(record_item_type type)
+        : m_type(type)
+    {}
+};
+
+}
+
+class recorder : public i_recorder
+{
+    const stream_position m_pos;
+
+    mutable std::mutex m_mx;
+    std::condition_variable m_cv;
+    std::deque<record_item> m_items;    // guarded by m_mx
+    size_t m_queued_bytes = 0;          // guarded by m_mx
+    bool m_need_keyframe = false;       // guarded by m_mx, packets were dropped
+    bool m_stop = false;                // guarded by m_mx
+    std::thread m_thread;               // started by the first begin() under m_mx
+
+    // writer thread only
+    codec_parameters_ptr m_par;
+    AVRational m_time_base;
+    AVFormatContext* m_fmt = nullptr;
+    AVStream* m_stream = nullptr;
+    AVPacket* m_pkt = nullptr;
+    bool m_header_written = false;
+    std::string m_file_name;
+    int64_t m_ts_offset = 0;        // first dts of the file, the file starts at zero
+    int64_t m_last_dts = AV_NOPTS_VALUE;
+    int64_t m_file_start_us = 0;    // av_gettime_relative
+    int64_t m_file_bytes = 0;
+
+    std::atomic<bool> m_recording;
+    std::atomic<double> m_kbps;
+    std::atomic<uint64_t> m_packets;
+    std::atomic<uint64_t> m_bytes;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<uint64_t> m_files;
+public:
+    explicit recorder(stream_position pos)
+        : m_pos(pos)
+        , m_recording(false)
+        , m_kbps(0)
+        , m_packets(0)
+        , m_bytes(0)
+        , m_dropped(0)
+        , m_files(0)
+    {}
+
+    ~recorder()
+    {
+        stop();
+        LOG("~recorder " << this);
+    }
+
+    virtual void begin(const AVCodecParameters* par, const AVRational& time_base)
+    {
+        record_item item(record_item_type::begin);
+        item.m_par.reset(avcodec_parameters_alloc(), [](AVCodecParameters* p){avcodec_parameters_free(&p);});
+        if (!item.m_par || avcodec_parameters_copy(item.m_par.get(), par) < 0) {
+            LOG_CONS("stream " << m_pos + 1 << " recording failed, out of memory");
+            return;
+        }
+        item.m_time_base = time_base;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mx);
+            if (m_stop)
+                return;
+            if (!m_thread.joinable())
+                start_thread();
+            m_items.push_back(item);
+            m_need_keyframe = false;
+        }
+        m_cv.notify_one();
+        m_recording = true;
+    }
+
+    virtual void push_packet(AVPacketPtr packet)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mx);
+            if (m_stop || !m_thread.joinable())
+                return;
+
+            // a gap has to start on a keyframe, the file stays decodable
+            bool key = packet->flags & AV_PKT_FLAG_KEY;
+            if (m_queued_bytes + packet->size > get_app_config().m_rec_buffer_kb * 1024
+                || (m_need_keyframe && !key)) {
+                m_need_keyframe = true;
+                ++m_dropped;
+                return;
+            }
+            m_need_keyframe = false;
+
+            record_item item(record_item_type::packet);
+            item.m_packet = packet;
+            m_items.push_back(item);
+            m_queued_bytes += packet->size;
+        }
+        m_cv.notify_one();
+    }
+
+    virtual void end()
+    {
+        m_recording = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mx);
+            if (m_stop || !m_thread.joinable())
+                return;
+            m_items.push_back(record_item(record_item_type::end));
+        }
+        m_cv.notify_one();
+    }
+
+    virtual recorder_stats stats() const
+    {
+        recorder_stats st;
+        st.m_recording = m_recording;
+        st.m_kbps = m_kbps;
+        st.m_packets = m_packets;
+        st.m_bytes = m_bytes;
+        st.m_dropped = m_dropped;
+        st.m_files = m_files;
+        {
+            std::lock_guard<std::mutex> lock(m_mx);
+            st.m_queue_packets = m_items.size();
+            st.m_queue_kb = m_queued_bytes / 1024;
+        }
+        return st;
+    }
+
+    virtual void stop()
+    {
+        m_recording = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mx);
+            m_stop = true;
+        }
+        m_cv.notify_one();
+
+        if (m_thread.joinable() && m_thread.get_id() != std::this_thread::get_id())
+            m_thread.join();
+    }
+
+private:
+    void start_thread()
+    {
+        m_thread = std::thread([this](){
+            register_current_thread("Recorder " + std::to_string(m_pos + 1));
+
+            LOG("Thread recorder started " << std::this_thread::get_id());
+            m_pkt = av_packet_alloc();
+            if (m_pkt)
+                run();
+            else
+                LOG_CONS("stream " << m_pos + 1 << " recording failed, out of memory");
+            close_file();
+            av_packet_free(&m_pkt);
+            LOG("Thread recorder stopped " << std::this_thread::get_id());
+        });
+    }
+
+    void run()
+    {
+        auto window_start = std::chrono::steady_clock::now();
+        uint64_t window_bytes = 0;
+
+        while (true) {
+            record_item item(record_item_type::end);
+            bool has_item = false;
+            {
+                std::unique_lock<std::mutex> lock(m_mx);
+                m_cv.wait_for(lock, std::chrono::seconds(1), [this](){return m_stop || !m_items.empty();});
+
+                // queued packets are written before stop
+                if (!m_items.empty()) {
+                    item = std::move(m_items.front());
+                    m_items.pop_front();
+                    has_item = true;
+                    if (item.m_packet)
+                        m_queued_bytes -= item.m_packet->size;
+                }
+                else
+                if (m_stop)
+                    break;
+            }
+
+            if (has_item) {
+                switch (item.m_type) {
+                case record_item_type::begin:
+                    close_file();
+                    m_par = item.m_par;
+                    m_time_base = item.m_time_base;
+                    break;
+                case record_item_type::packet:
+                    window_bytes += write(*item.m_packet);
+                    break;
+                case record_item_type::end:
+                    close_file();
+                    m_par.reset();
+                    break;
+                }
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            std::chrono::duration<double> elapsed = now - window_start;
+            if (elapsed.count() >= 1) {
+                m_kbps = window_bytes * 8 / 1000.0 / elapsed.count();
+                window_bytes = 0;
+                window_start = now;
+            }
+        }
+    }
+
+    bool segment_full() const
+    {
+        const app_config& cfg = get_app_config();
+        return (cfg.m_rec_segment_mb && m_file_bytes >= cfg.m_rec_segment_mb * 1024 * 1024)
+            || (cfg.m_rec_segment_sec && av_gettime_relative() - m_file_start_us >= cfg.m_rec_segment_sec * 1000000LL);
+    }
+
+    // bytes written, a failed file ends the recording up to the next begin()
+    int write(const AVPacket& packet)
+    {
+        if (!m_par)
+            return 0;
+
+        bool key = packet.flags & AV_PKT_FLAG_KEY;
+        int64_t dts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+
+        // loop or seek of the input, the old file can't take timestamps going back
+        bool went_back = dts != AV_NOPTS_VALUE && m_last_dts != AV_NOPTS_VALUE && dts - m_ts_offset <= m_last_dts;
+        if (m_fmt && key && (went_back || segment_full()))
+            close_file();
+
+        try {
+            if (!m_fmt) {
+                if (!key)
+                    return 0;
+                open_file(dts);
+            }
+
+            if (av_packet_ref(m_pkt, &packet) < 0)
+                THROW_ERR("Out of memory");
+
+            if (m_pkt->pts != AV_NOPTS_VALUE)
+                m_pkt->pts -= m_ts_offset;
+            if (m_pkt->dts != AV_NOPTS_VALUE) {
+                m_pkt->dts -= m_ts_offset;
+                // the muxer refuses dts going back, the file ends here and the next keyframe starts a new one;
+                // packets up to it depend on the skipped one
+                if (m_last_dts != AV_NOPTS_VALUE && m_pkt->dts <= m_last_dts) {
+                    LOG("stream " << m_pos + 1 << " recording: dts " << m_pkt->dts << " after " << m_last_dts
+                        << ", new file on next keyframe");
+                    av_packet_unref(m_pkt);
+                    close_file();
+                    return 0;
+                }
+                m_last_dts = m_pkt->dts;
+            }
+            av_packet_rescale_ts(m_pkt, m_time_base, m_stream->time_base);
+            m_pkt->stream_index = m_stream->index;
+            m_pkt->pos = -1;
+
+            int size = m_pkt->size;
+            // muxer takes the packet reference
+            if (av_interleaved_write_frame(m_fmt, m_pkt) < 0)
+                THROW_ERR("Error writing packet to " << m_file_name);
+
+            m_file_bytes += size;
+            m_bytes += size;
+            ++m_packets;
+            return size;
+        }
+        catch(std::exception& e) {
+            LOG_CONS("stream " << m_pos + 1 << " recording stopped: " << e.what());
+            av_packet_unref(m_pkt);
+            close_file();
+            m_par.reset();
+            m_recording = false;
+            return 0;
+        }
+    }
+
+    void open_file(int64_t first_dts)
+    {
+        const app_config& cfg = get_app_config();
+        std::ostringstream name;
+        name << cfg.m_rec_dir << "/stream" << m_pos + 1 << '_' << file_time_stamp() << '.'
+             << record_format_name(cfg.m_rec_format);
+        m_file_name = name.str();
+
+        if (avformat_alloc_output_context2(&m_fmt, nullptr, muxer_name(cfg.m_rec_format), m_file_name.c_str()) < 0
+            || !m_fmt)
+            THROW_ERR("Could not create muxer for " << m_file_name);
+
+        m_stream = avformat_new_stream(m_fmt, nullptr);
+        if (!m_stream)
+            THROW_ERR("Could not create output stream");
+        if (avcodec_parameters_copy(m_stream->codecpar, m_par.get()) < 0)
+            THROW_ERR("Could not copy stream parameters");
+        // tag of the input container may mean nothing in the output one
+        m_stream->codecpar->codec_tag = 0;
+        m_stream->time_base = m_time_base;
+
+        if (!(m_fmt->oformat->flags & AVFMT_NOFILE)) {
+            if (avio_open(&m_fmt->pb, m_file_name.c_str(), AVIO_FLAG_WRITE) < 0)
+                THROW_ERR("Could not open " << m_file_name);
+        }
+
+        AVDictionary* opts = nullptr;
+        AutoFree free_opts([&opts](){av_dict_free(&opts);});
+        if (cfg.m_rec_format == record_format::mp4)
+            av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov", 0);
+
+        if (avformat_write_header(m_fmt, &opts) < 0)
+            THROW_ERR("Could not write header to " << m_file_name);
+        m_header_written = true;
+
+        m_ts_offset = first_dts != AV_NOPTS_VALUE ? first_dts : 0;
+        m_last_dts = AV_NOPTS_VALUE;
+        m_file_start_us = av_gettime_relative();
+        m_file_bytes = 0;
+        ++m_files;
+        LOG_CONS("stream " << m_pos + 1 << " recording to " << m_file_name);
+    }
+
+    void close_file()
+    {
+        if (!m_fmt)
+            return;
+
+        if (m_header_written && av_write_trailer(m_fmt) < 0)
+            LOG_CONS("Error writing trailer to " << m_file_name);
+        m_header_written = false;
+
+        if (!(m_fmt->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&m_fmt->pb);
+        avformat_free_context(m_fmt);
+        m_fmt = nullptr;
+        m_stream = nullptr;
+        LOG("stream " << m_pos + 1 << " recorded " << m_file_name << " " << m_file_bytes << " bytes");
+    }
+};
+
+i_recorder_ptr create_recorder(stream_position pos)
+{
+    return std::make_shared<recorder>(pos);
+}
+
+}
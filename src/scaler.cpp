@@ -0,0 +1,175 @@
+#include "scaler.h"
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "ffmpeg_afx.h"
+
+// threaded slices and sws_scale_frame came in the same libswscale version
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+#define MSTREAM_SWS_THREADS 1
+#else
+#define MSTREAM_SWS_THREADS 0
+#endif
+
+namespace mstream
+{
+
+namespace
+{
+
+int sws_flags(scaler_profile profile)
+{
+    switch (profile) {
+    case scaler_profile::fast_bilinear: return SWS_FAST_BILINEAR;
+    case scaler_profile::bilinear: return SWS_BILINEAR;
+    case scaler_profile::area: return SWS_AREA;
+    case scaler_profile::bicubic: return SWS_BICUBIC;
+    case scaler_profile::lanczos: return SWS_LANCZOS;
+    }
+    return SWS_BICUBIC;
+}
+
+bool same_plane(const uint8_t* a, int a_linesize, const uint8_t* b, int b_linesize, int width, int height)
+{
+    for (int y = 0; y < height; ++y) {
+        if (memcmp(a + (ptrdiff_t)y * a_linesize, b + (ptrdiff_t)y * b_linesize, width))
+            return false;
+    }
+    return true;
+}
+
+}
+
+frame_scaler::~frame_scaler()
+{
+    if (m_sws)
+        sws_freeContext(m_sws);
+}
+
+void frame_scaler::scale(const AVFrame* src, AVFrame* dst, scaler_profile profile)
+{
+    int threads = wanted_threads(src);
+    if (!m_sws || src->width != m_width || src->height != m_height || src->format != m_format
+        || dst->width != m_dst_width || dst->height != m_dst_height || profile != m_profile
+        || threads != m_threads)
+        rebuild(src, dst, profile, threads);
+
+    run(m_sws, m_threads, src, dst);
+
+    if (!m_verify)
+        return;
+    m_verify = false;
+
+    if (!same_as_single_thread(src, dst)) {
+        LOG_CONS("stream " << m_pos << " sliced scaling differs from single threaded, slices are off");
+        m_slices_broken = true;
+        rebuild(src, dst, profile, 1);
+        run(m_sws, m_threads, src, dst);
+    }
+}
+
+int frame_scaler::wanted_threads(const AVFrame* src) const
+{
+#if MSTREAM_SWS_THREADS
+    const app_config& cfg = get_app_config();
+    if (m_slices_broken || !cfg.m_scale_slice_pixels || src->width * src->height < cfg.m_scale_slice_pixels)
+        return 1;
+
+    int threads = cfg.m_scale_threads;
+    if (!threads)
+        threads = std::min(4u, std::max(1u, std::thread::hardware_concurrency()));
+    return threads;
+#else
+    (void)src;
+    return 1;
+#endif
+}
+
+void frame_scaler::rebuild(const AVFrame* src, const AVFrame* dst, scaler_profile profile, int threads)
+{
+    m_width = src->width;
+    m_height = src->height;
+    m_format = src->format;
+    m_dst_width = dst->width;
+    m_dst_height = dst->height;
+    m_profile = profile;
+    m_threads = threads;
+    m_verify = threads > 1;
+
+    if (m_sws)
+        sws_freeContext(m_sws);
+    m_sws = create(threads);
+
+    const char* fmt = av_get_pix_fmt_name((AVPixelFormat)src->format);
+    LOG("stream " << m_pos << " scaler " << m_width << "x" << m_height << " " << (fmt ? fmt : "?")
+        << " to " << m_dst_width << "x" << m_dst_height << " " << scaler_profile_name(profile)
+        << " slices " << threads);
+}
+
+SwsContext* frame_scaler::create(int threads) const
+{
+    SwsContext* sws = sws_alloc_context();
+    if (!sws)
+        THROW_ERR("Cannot allocate scale context");
+
+    av_opt_set_int(sws, "srcw", m_width, 0);
+    av_opt_set_int(sws, "srch", m_height, 0);
+    av_opt_set_int(sws, "src_format", m_format, 0);
+    av_opt_set_int(sws, "dstw", m_dst_width, 0);
+    av_opt_set_int(sws, "dsth", m_dst_height, 0);
+    av_opt_set_int(sws, "dst_format", AV_PIX_FMT_YUV420P, 0);
+    av_opt_set_int(sws, "sws_flags", sws_flags(m_profile), 0);
+#if MSTREAM_SWS_THREADS
+    av_opt_set_int(sws, "threads", threads, 0);
+#else
+    (void)threads;
+#endif
+
+    if (sws_init_context(sws, NULL, NULL) < 0) {
+        sws_freeContext(sws);
+        THROW_ERR("Cannot init scale context");
+    }
+    return sws;
+}
+
+void frame_scaler::run(SwsContext* sws, int threads, const AVFrame* src, AVFrame* dst) const
+{
+#if MSTREAM_SWS_THREADS
+    // only the frame api splits the output between the context threads
+    if (threads > 1) {
+        if (sws_scale_frame(sws, dst, src) < 0)
+            THROW_ERR("Error scaling frame");
+        return;
+    }
+#else
+    (void)threads;
+#endif
+    sws_scale(sws, src->data, src->linesize, 0, src->height, dst->data, dst->linesize);
+}
+
+bool frame_scaler::same_as_single_thread(const AVFrame* src, const AVFrame* dst) const
+{
+    AVFrame* ref = av_frame_alloc();
+    AutoFree free_ref([&ref](){av_frame_free(&ref);});
+    if (!ref)
+        return false;
+    ref->format = AV_PIX_FMT_YUV420P;
+    ref->width = dst->width;
+    ref->height = dst->height;
+    if (av_frame_get_buffer(ref, 0) < 0)
+        return false;
+
+    SwsContext* single = create(1);
+    AutoFree free_single([single](){sws_freeContext(single);});
+    run(single, 1, src, ref);
+
+    int chroma_w = (dst->width + 1) / 2;
+    int chroma_h = (dst->height + 1) / 2;
+    return same_plane(dst->data[0], dst->linesize[0], ref->data[0], ref->linesize[0], dst->width, dst->height)
+        && same_plane(dst->data[1], dst->linesize[1], ref->data[1], ref->linesize[1], chroma_w, chroma_h)
+        && same_plane(dst->data[2], dst->linesize[2], ref->data[2], ref->linesize[2], chroma_w, chroma_h);
+}
+
+}
@@ -0,0 +1,279 @@
+#include "snapshot.h"
+#include "ffmpeg_afx.h"
+#include "common.h"
+#include "spsc_ring.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <stdexcept>
+
+namespace mstream
+{
+
+namespace
+{
+
+struct snapshot_job
+{
+    AVFramePtr m_frame;
+    std::string m_file_name;
+};
+
+}
+
+class snapshot_writer : public i_snapshot_writer
+{
+    spsc_ring<snapshot_job> m_jobs;
+    std::mutex m_mx;
+    std::condition_variable m_cv;
+    bool m_stop = false;            // guarded by m_mx
+    std::thread m_thread;
+
+    // producer only, token bucket of m_snapshot_rate with one second of burst
+    double m_tokens;
+    int64_t m_refill_us;
+
+    // writer thread only
+    SwsContext* m_sws = nullptr;
+
+    std::atomic<uint64_t> m_written;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<uint64_t> m_failed;
+public:
+    snapshot_writer()
+        : m_jobs(get_app_config().m_snapshot_queue)
+        , m_tokens(burst())
+        , m_refill_us(av_gettime_relative())
+        , m_written(0)
+        , m_dropped(0)
+        , m_failed(0)
+    {}
+
+    ~snapshot_writer()
+    {
+        stop();
+        sws_freeContext(m_sws);
+        LOG("~snapshot_writer " << this);
+    }
+
+    void start_thread()
+    {
+        m_thread = std::thread([this](){
+            register_current_thread("Snapshot");
+
+            LOG("Thread snapshot started " << std::this_thread::get_id());
+            run();
+            LOG("Thread snapshot stopped " << std::this_thread::get_id());
+        });
+    }
+
+    virtual bool can_write()
+    {
+        int64_t now = av_gettime_relative();
+        m_tokens = std::min(burst(), m_tokens + (now - m_refill_us) * get_app_config().m_snapshot_rate / 1000000);
+        m_refill_us = now;
+
+        if (m_tokens < 1 || m_jobs.full()) {
+            ++m_dropped;
+            return false;
+        }
+        return true;
+    }
+
+    virtual bool write(AVFramePtr frame, const std::string& file_name)
+    {
+        snapshot_job job;
+        job.m_frame = frame;
+        job.m_file_name = file_name;
+        if (!m_jobs.push(job)) {
+            ++m_dropped;
+            return false;
+        }
+        m_tokens -= 1;
+
+        // empty critical section orders the push before the check in the waiting thread
+        {
+            std::lock_guard<std::mutex> lock(m_mx);
+        }
+        m_cv.notify_one();
+        return true;
+    }
+
+    virtual snapshot_stats stats() const
+    {
+        snapshot_stats st;
+        st.m_written = m_written;
+        st.m_dropped = m_dropped;
+        st.m_failed = m_failed;
+        st.m_queue_depth = m_jobs.size();
+        st.m_queue_capacity = m_jobs.capacity();
+        return st;
+    }
+
+    virtual void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mx);
+            m_stop = true;
+        }
+        m_cv.notify_one();
+
+        if (m_thread.joinable() && m_thread.get_id() != std::this_thread::get_id())
+            m_thread.join();
+    }
+
+private:
+    static double burst()
+    {
+        return std::max(1.0, get_app_config().m_snapshot_rate);
+    }
+
+    void run()
+    {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m_mx);
+                m_cv.wait(lock, [this](){return m_stop || m_jobs.front();});
+            }
+
+            // queued snapshots are written before stop
+            snapshot_job* front = m_jobs.front();
+            if (!front) {
+                std::lock_guard<std::mutex> lock(m_mx);
+                if (m_stop)
+                    break;
+                continue;
+            }
+
+            snapshot_job job = *front;
+            m_jobs.pop();
+            try {
+                save(job);
+                ++m_written;
+            }
+            catch(std::exception& e) {
+                ++m_failed;
+                LOG_CONS("snapshot " << job.m_file_name << " failed: " << e.what());
+            }
+        }
+    }
+
+    // the encoders take full range pictures, decoded tiles are limited range yuv420p
+    AVFramePtr convert(const AVFramePtr& src, AVPixelFormat pix_fmt)
+    {
+        AVFramePtr dst = make_frame_ptr(av_frame_alloc());
+        if (!dst)
+            THROW_ERR("Error frame allocate");
+
+        dst->format = pix_fmt;
+        dst->width = src->width;
+        dst->height = src->height;
+        if (av_frame_get_buffer(dst.get(), 32) < 0)
+            THROW_ERR("Error allocate buffer");
+
+        m_sws = sws_getCachedContext(m_sws, src->width, src->height, (AVPixelFormat)src->format,
+                                     dst->width, dst->height, pix_fmt, SWS_BICUBIC, nullptr, nullptr, nullptr);
+        if (!m_sws)
+            THROW_ERR("Could not create scaler");
+
+        sws_scale(m_sws, src->data, src->linesize, 0, src->height, dst->data, dst->linesize);
+        return dst;
+    }
+
+    void save(const snapshot_job& job)
+    {
+        AVCodecID codec_id = AV_CODEC_ID_MJPEG;
+        AVPixelFormat pix_fmt = AV_PIX_FMT_YUVJ420P;
+        switch (get_app_config().m_snapshot_format) {
+        case snapshot_format::pgm:
+            codec_id = AV_CODEC_ID_PGM;
+            pix_fmt = AV_PIX_FMT_GRAY8;
+            break;
+        case snapshot_format::png:
+            codec_id = AV_CODEC_ID_PNG;
+            pix_fmt = AV_PIX_FMT_RGB24;
+            break;
+        case snapshot_format::jpg:
+            break;
+        }
+
+        const AVCodec* codec = avcodec_find_encoder(codec_id);
+        if (!codec)
+            THROW_ERR("No " << snapshot_format_name(get_app_config().m_snapshot_format) << " encoder");
+
+        AVFramePtr frame = convert(job.m_frame, pix_fmt);
+
+        // image encoders are cheap to open, every snapshot may have its own size
+        AVCodecContext* enc = avcodec_alloc_context3(codec);
+        if (!enc)
+            THROW_ERR("Could not allocate encoder context");
+        AutoFree free_enc([&enc](){avcodec_free_context(&enc);});
+
+        enc->width = frame->width;
+        enc->height = frame->height;
+        enc->pix_fmt = pix_fmt;
+        enc->time_base = AVRational{1, 25};
+        if (codec_id == AV_CODEC_ID_MJPEG) {
+            enc->flags |= AV_CODEC_FLAG_QSCALE;
+            enc->global_quality = FF_QP2LAMBDA * 3;
+            frame->quality = enc->global_quality;
+        }
+
+        if (avcodec_open2(enc, codec, nullptr) < 0)
+            THROW_ERR("Could not open encoder " << codec->name);
+
+        frame->pts = 0;
+        if (avcodec_send_frame(enc, frame.get()) < 0 || avcodec_send_frame(enc, nullptr) < 0)
+            THROW_ERR("Error sending a frame to encoder");
+
+        AVPacket* pkt = av_packet_alloc();
+        if (!pkt)
+            THROW_ERR("Could not allocate packet");
+        AutoFree free_pkt([&pkt](){av_packet_free(&pkt);});
+
+        if (avcodec_receive_packet(enc, pkt) < 0)
+            THROW_ERR("Error during encoding");
+
+        // written next to the target and renamed, the dashboard never reads half of the file
+        std::string tmp_name = job.m_file_name + ".tmp";
+        {
+            std::ofstream out(tmp_name, std::ios::binary);
+            out.write((const char*)pkt->data, pkt->size);
+            if (!out)
+                THROW_ERR("cannot write " << tmp_name);
+        }
+
+        if (std::rename(tmp_name.c_str(), job.m_file_name.c_str()))
+            THROW_ERR("cannot rename " << tmp_name << " to " << job.m_file_name);
+
+        LOG("snapshot " << job.m_file_name << " " << pkt->size << " bytes");
+    }
+};
+
+i_snapshot_writer_ptr start_snapshot_writer()
+{
+    auto writer = std::make_shared<snapshot_writer>();
+    writer->start_thread();
+    return writer;
+}
+
+std::string snapshot_path(const std::string& name, bool timestamped)
+{
+    const app_config& cfg = get_app_config();
+    std::ostringstream path;
+    path << cfg.m_snapshot_dir << '/' << name;
+
+    if (timestamped)
+        path << '_' << file_time_stamp();
+
+    path << '.' << snapshot_format_name(cfg.m_snapshot_format);
+    return path.str();
+}
+
+}
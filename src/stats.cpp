@@ -0,0 +1,289 @@
+#include "stats.h"
+#include "encoder.h"
+
+#include <fstream>
+#include <iomanip>
+#include <cstdio>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace mstream
+{
+
+double histogram_snapshot::mean() const
+{
+    return m_count ? (double)m_sum / m_count : 0;
+}
+
+histogram_snapshot histogram_snapshot::since(const histogram_snapshot& earlier) const
+{
+    histogram_snapshot diff = *this;
+    diff.m_count -= earlier.m_count;
+    diff.m_sum -= earlier.m_sum;
+    for (size_t i = 0; i < diff.m_buckets.size() && i < earlier.m_buckets.size(); ++i)
+        diff.m_buckets[i] -= earlier.m_buckets[i];
+    return diff;
+}
+
+double histogram_snapshot::percentile(double p) const
+{
+    if (!m_count)
+        return 0;
+
+    uint64_t rank = (uint64_t)(p * m_count);
+    if (rank >= m_count)
+        rank = m_count - 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < m_buckets.size(); ++i) {
+        seen += m_buckets[i];
+        if (seen > rank) {
+            double mid = histogram::bucket_low((int)i) + (histogram::bucket_width((int)i) - 1) / 2.0;
+            return std::min(mid, (double)m_max);
+        }
+    }
+
+    return (double)m_max;
+}
+
+histogram::histogram()
+    : m_count(0)
+    , m_sum(0)
+    , m_max(0)
+{
+    for (auto& bucket : m_buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+histogram_snapshot histogram::snapshot() const
+{
+    histogram_snapshot snap;
+    snap.m_count = m_count.load(std::memory_order_relaxed);
+    snap.m_sum = m_sum.load(std::memory_order_relaxed);
+    snap.m_max = m_max.load(std::memory_order_relaxed);
+    snap.m_buckets.resize(bucket_count);
+    for (int i = 0; i < bucket_count; ++i)
+        snap.m_buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+    return snap;
+}
+
+uint64_t histogram::bucket_low(int index)
+{
+    if (index < sub_count)
+        return index;
+    int shift = index / sub_count - 1;
+    return (uint64_t)(sub_count + index % sub_count) << shift;
+}
+
+uint64_t histogram::bucket_width(int index)
+{
+    return index < sub_count ? 1 : 1ull << (index / sub_count - 1);
+}
+
+namespace
+{
+
+std::vector< std::unique_ptr<stream_stats> > make_stream_stats()
+{
+    std::vector< std::unique_ptr<stream_stats> > stats(stream_count());
+    for (auto& st : stats)
+        st.reset(new stream_stats());
+    return stats;
+}
+
+struct named_histogram
+{
+    const char* m_name;
+    const histogram stream_stats::* m_hist;
+};
+
+const named_histogram g_histograms[] = {
+    {"read_us", &stream_stats::m_read_us},
+    {"packet_queue_kb", &stream_stats::m_packet_queue_kb},
+    {"decode_us", &stream_stats::m_decode_us},
+    {"scale_us", &stream_stats::m_scale_us},
+    {"first_frame_ms", &stream_stats::m_first_frame_ms},
+    {"switch_ms", &stream_stats::m_switch_ms},
+    {"stop_ms", &stream_stats::m_stop_ms},
+    {"queue_wait_us", &stream_stats::m_queue_wait_us},
+    {"compose_us", &stream_stats::m_compose_us},
+    {"present_delay_us", &stream_stats::m_present_delay_us},
+    {"queue_depth", &stream_stats::m_queue_depth},
+};
+
+void write_histogram_text(std::ostream& out, const char* name, const histogram_snapshot& snap)
+{
+    out << "  " << std::left << std::setw(18) << name << std::right
+        << " n " << snap.m_count
+        << " mean " << (int64_t)snap.mean()
+        << " p50 " << (int64_t)snap.percentile(0.5)
+        << " p90 " << (int64_t)snap.percentile(0.9)
+        << " p99 " << (int64_t)snap.percentile(0.99)
+        << " max " << snap.m_max << std::endl;
+}
+
+void write_histogram_json(std::ostream& out, const char* name, const histogram_snapshot& snap)
+{
+    out << "\"" << name << "\": {"
+        << "\"count\": " << snap.m_count
+        << ", \"mean\": " << snap.mean()
+        << ", \"p50\": " << snap.percentile(0.5)
+        << ", \"p90\": " << snap.percentile(0.9)
+        << ", \"p99\": " << snap.percentile(0.99)
+        << ", \"max\": " << snap.m_max << "}";
+}
+
+bool ends_with(const std::string& str, const std::string& suffix)
+{
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// written next to the target and renamed, a reader never sees half of the file
+void dump_stats_file(const std::string& file_name, const std::shared_ptr<i_frame_consumer>& cons)
+{
+    std::string tmp_name = file_name + ".tmp";
+    {
+        std::ofstream out(tmp_name);
+        if (ends_with(file_name, ".json"))
+            write_stats_json(out, cons);
+        else
+            write_stats_text(out, cons);
+        if (!out) {
+            LOG("cannot write " << tmp_name);
+            return;
+        }
+    }
+
+    if (std::rename(tmp_name.c_str(), file_name.c_str()))
+        LOG("cannot rename " << tmp_name << " to " << file_name);
+}
+
+// file I/O stays off the decoder and io pools, a slow disk delays only the next dump
+class stats_dump : public i_stats_dump
+{
+    const std::shared_ptr<i_frame_consumer> m_cons;
+    std::mutex m_mx;
+    std::condition_variable m_cv;
+    bool m_stop = false;        // guarded by m_mx
+    std::thread m_thread;
+public:
+    explicit stats_dump(std::shared_ptr<i_frame_consumer> cons)
+        : m_cons(cons)
+    {}
+
+    ~stats_dump()
+    {
+        stop();
+    }
+
+    void start_thread()
+    {
+        m_thread = std::thread([this](){
+            register_current_thread("Stats dump");
+            run();
+        });
+    }
+
+    virtual void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mx);
+            m_stop = true;
+        }
+        m_cv.notify_one();
+
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+
+private:
+    void run()
+    {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m_mx);
+                if (m_cv.wait_for(lock, std::chrono::seconds(get_app_config().m_stats_interval),
+                        [this](){return m_stop;}))
+                    break;
+            }
+            if (m_cons->done())
+                break;
+            dump_stats_file(get_app_config().m_stats_file, m_cons);
+        }
+    }
+};
+
+}
+
+stream_stats& get_stream_stats(stream_position pos)
+{
+    static std::vector< std::unique_ptr<stream_stats> > s_stats = make_stream_stats();
+    return *s_stats[pos];
+}
+
+consumer_stats& get_consumer_stats()
+{
+    static consumer_stats s_stats;
+    return s_stats;
+}
+
+void write_stats_text(std::ostream& out, const std::shared_ptr<i_frame_consumer>& cons)
+{
+    for (stream_position pos = 0; pos < stream_count(); ++pos) {
+        frame_counters fc = cons->counters(pos);
+        out << "stream " << pos + 1 << " shown " << fc.m_shown << " late " << fc.m_late
+            << " dropped " << fc.m_dropped << " catchups " << fc.m_catchups << std::endl;
+
+        const stream_stats& st = get_stream_stats(pos);
+        for (const named_histogram& h : g_histograms)
+            write_histogram_text(out, h.m_name, (st.*h.m_hist).snapshot());
+    }
+
+    const consumer_stats& cs = get_consumer_stats();
+    out << "consumer cpu ms " << cs.m_cpu_us / 1000 << std::endl;
+    write_histogram_text(out, "wakeup_late_us", cs.m_wakeup_late_us.snapshot());
+}
+
+void write_stats_json(std::ostream& out, const std::shared_ptr<i_frame_consumer>& cons)
+{
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    out << "{\"time_ms\": " << std::chrono::duration_cast<std::chrono::milliseconds>(now).count()
+        << ", \"streams\": [";
+    for (stream_position pos = 0; pos < stream_count(); ++pos) {
+        frame_counters fc = cons->counters(pos);
+        out << (pos ? "," : "") << std::endl
+            << "  {\"stream\": " << pos + 1
+            << ", \"shown\": " << fc.m_shown
+            << ", \"late\": " << fc.m_late
+            << ", \"dropped\": " << fc.m_dropped
+            << ", \"catchups\": " << fc.m_catchups;
+
+        const stream_stats& st = get_stream_stats(pos);
+        for (const named_histogram& h : g_histograms) {
+            out << "," << std::endl << "   ";
+            write_histogram_json(out, h.m_name, (st.*h.m_hist).snapshot());
+        }
+        out << "}";
+    }
+
+    const consumer_stats& cs = get_consumer_stats();
+    out << std::endl << "], \"consumer\": {\"cpu_ms\": " << cs.m_cpu_us / 1000 << ", ";
+    write_histogram_json(out, "wakeup_late_us", cs.m_wakeup_late_us.snapshot());
+    out << "}}" << std::endl;
+}
+
+i_stats_dump_ptr start_stats_dump(std::shared_ptr<i_frame_consumer> cons)
+{
+    const app_config& cfg = get_app_config();
+    if (cfg.m_stats_file.empty() || cfg.m_stats_interval <= 0)
+        return i_stats_dump_ptr();
+
+    auto dump = std::make_shared<stats_dump>(cons);
+    dump->start_thread();
+    return dump;
+}
+
+}
@@ -1,6 +1,10 @@
 #include "common.h"
 #include "decoder.h"
 #include "encoder.h"
+#include "output.h"
+#include "stats.h"
+#include "worker_pool.h"
+#include "quality_controller.h"
 
 #include <fstream>
 #include <iostream>
@@ -8,19 +12,23 @@
 #include <thread>
 #include <chrono>
 
-namespace mstream {
-    bool g_unloaded = false;
-}
-
 using namespace mstream;
 
 namespace {
 void print_help()
 {
     std::cout << "Use console commands: " << std::endl
-        << "url [1,2,3,4] <url>: set url for stream. url can be system variable $VAR" << std::endl
+        << "url [1.." << stream_count() << "] <url>: set url for stream. url can be system variable $VAR" << std::endl
+        << "threads [1.." << stream_count() << "] <count|auto>: decoder threads for stream, auto - share of core budget" << std::endl
+        << "pause|resume|stop [1.." << stream_count() << "]: pause, resume or close stream" << std::endl
+        << "seek [1.." << stream_count() << "] <seconds>: seek from the start of input" << std::endl
+        << "quality [1.." << stream_count() << "] <auto|full|skip_loop_filter|skip_nonref|lowres|skip_nonkey>: decode quality" << std::endl
+        << "snap [1.." << stream_count() << "]|all: save picture of the tile or of the whole mosaic" << std::endl
+        << "rec [1.." << stream_count() << "] <start|stop>: record stream packets to file without transcoding" << std::endl
         << "q or quit: exit programm" << std::endl
         << "cfg : reload from config" << std::endl
+        << "stats: show streams state" << std::endl
+        << "log <error|info|debug>: log level" << std::endl
         << "help: show this message" << std::endl;
 }
 
@@ -31,17 +39,27 @@ enum class process_action
     exit,
     cfg,
     open_url,
+    set_threads,
+    pause,
+    resume,
+    stop,
+    seek,
+    set_quality,
+    record,
+    snapshot,
+    stats,
+    set_log_level,
     help,
 };
     
-process_action process_cmd(const std::string& input, int& stream_num, std::string& url)
+process_action process_cmd(const std::string& input, int& stream_num, std::string& arg)
 {
     std::istringstream f(input);
     std::string s;
-    bool doexit = false;
+    process_action action = process_action::error;
 
     enum class cmd_states{
-        free,waiting_num,waiting_url
+        free,waiting_num,waiting_arg
     };
     
     cmd_states state = cmd_states::free;
@@ -50,10 +68,49 @@ process_action process_cmd(const std::string& input, int& stream_num, std::strin
         if (cmd_states::free == state ) {
             if (s[0] == '#') // comment
                 return process_action::skip;
+            if (s == "set") // option, applied on start by load_app_config
+                return process_action::skip;
             if (s == "url") {
+                action = process_action::open_url;
+                state = cmd_states::waiting_num;
+            }
+            else
+            if (s == "threads") {
+                action = process_action::set_threads;
+                state = cmd_states::waiting_num;
+            }
+            else
+            if (s == "pause" || s == "resume" || s == "stop") {
+                action = s == "pause" ? process_action::pause
+                       : s == "resume" ? process_action::resume : process_action::stop;
+                state = cmd_states::waiting_num;
+            }
+            else
+            if (s == "seek") {
+                action = process_action::seek;
+                state = cmd_states::waiting_num;
+            }
+            else
+            if (s == "quality") {
+                action = process_action::set_quality;
+                state = cmd_states::waiting_num;
+            }
+            else
+            if (s == "rec") {
+                action = process_action::record;
                 state = cmd_states::waiting_num;
             }
             else
+            if (s == "snap") {
+                action = process_action::snapshot;
+                state = cmd_states::waiting_arg;
+            }
+            else
+            if (s == "log") {
+                action = process_action::set_log_level;
+                state = cmd_states::waiting_arg;
+            }
+            else
             if (s == "cfg") {
                 return process_action::cfg;
             }
@@ -62,6 +119,10 @@ process_action process_cmd(const std::string& input, int& stream_num, std::strin
                 return process_action::help;
             }
             else
+            if (s == "stats") {
+                return process_action::stats;
+            }
+            else
             if (s == "q" || s == "quit") {
                 return process_action::exit;
             } else 
@@ -71,32 +132,134 @@ process_action process_cmd(const std::string& input, int& stream_num, std::strin
             try{
                 stream_num = std::stoi(s);
             } catch(...) {}
-            if (stream_num < 1 || stream_num > 4) {
-                std::cout << "Stream num should be between 1 and 4" << std::endl;
+            if (stream_num < 1 || stream_num > (int)stream_count()) {
+                std::cout << "Stream num should be between 1 and " << stream_count() << std::endl;
                 return process_action::error;
             }
             --stream_num;
-            state = cmd_states::waiting_url;
+            state = cmd_states::waiting_arg;
         } else
-        if (cmd_states::waiting_url == state) {
+        if (cmd_states::waiting_arg == state) {
             if (!s.empty()) {
-                if (s.at(0) == '$') {
+                if (action == process_action::open_url && s.at(0) == '$') {
                     if (getenv(s.c_str()+1))
-                        url = getenv(s.c_str()+1);
+                        arg = getenv(s.c_str()+1);
                 }
                 else
-                    url = s;
+                    arg = s;
             }
             
-            return process_action::open_url;
+            return action;
         }
     }
     
-    if (cmd_states::waiting_url == state)
-        return process_action::open_url; // clear strem
+    // commands without argument, empty url clears the stream
+    if (cmd_states::waiting_arg == state && (action == process_action::open_url || action == process_action::pause
+                                             || action == process_action::resume || action == process_action::stop))
+        return action;
     return process_action::error;
 }
 
+// false if action is not for a stream or its argument is wrong
+bool apply_stream_action(process_action action, std::vector<i_decoder_context_ptr>& decoders,
+                         int stream_num, const std::string& arg)
+{
+    switch (action) {
+    case process_action::open_url:
+        decoders[stream_num]->set_url(arg);
+        return true;
+    case process_action::set_threads:
+        if (arg == "auto") {
+            decoders[stream_num]->set_threads(0);
+            return true;
+        }
+        try {
+            int threads = std::stoi(arg);
+            if (threads > 0) {
+                decoders[stream_num]->set_threads(threads);
+                return true;
+            }
+        } catch(...) {}
+        return false;
+    case process_action::pause:
+        decoders[stream_num]->pause();
+        return true;
+    case process_action::resume:
+        decoders[stream_num]->resume();
+        return true;
+    case process_action::stop:
+        decoders[stream_num]->set_url("");
+        return true;
+    case process_action::seek:
+        try {
+            double seconds = std::stod(arg);
+            if (seconds >= 0) {
+                decoders[stream_num]->seek(seconds);
+                return true;
+            }
+        } catch(...) {}
+        return false;
+    case process_action::set_quality:
+        {
+            int level = -1;
+            if (arg != "auto" && !parse_quality_level(arg, level))
+                return false;
+            decoders[stream_num]->set_quality(level);
+            return true;
+        }
+    case process_action::record:
+        if (arg != "start" && arg != "stop")
+            return false;
+        decoders[stream_num]->record(arg == "start");
+        return true;
+    default:
+        return false;
+    }
+}
+
+// stream number or "all" for the mosaic, false if it is neither
+bool request_snapshot(const i_frame_consumer_master_ptr& cons, const std::string& arg)
+{
+    if (arg == "all") {
+        cons->snapshot_mosaic();
+        return true;
+    }
+
+    int stream_num = 0;
+    try {
+        stream_num = std::stoi(arg);
+    } catch(...) {}
+    if (stream_num < 1 || stream_num > (int)stream_count())
+        return false;
+
+    cons->snapshot((stream_position)(stream_num - 1));
+    return true;
+}
+
+void print_stats(const std::vector<i_decoder_context_ptr>& decoders, const i_frame_consumer_master_ptr& cons,
+                 const i_output_ptr& output)
+{
+    for (size_t i = 0; i < decoders.size(); ++i) {
+        std::cout << "stream " << i + 1 << " quality " << quality_level_name(decoders[i]->quality_level()) << std::endl;
+        recorder_stats rs = decoders[i]->recording_stats();
+        if (rs.m_recording || rs.m_files)
+            std::cout << "stream " << i + 1 << " recording " << (rs.m_recording ? "on" : "off")
+                << " kbps " << rs.m_kbps << " packets " << rs.m_packets << " bytes " << rs.m_bytes
+                << " files " << rs.m_files << " dropped " << rs.m_dropped
+                << " queue " << rs.m_queue_packets << " packets " << rs.m_queue_kb << " KB" << std::endl;
+    }
+    write_stats_text(std::cout, cons);
+    if (output) {
+        output_stats os = output->stats();
+        std::cout << "output fps " << os.m_fps << " encoded " << os.m_encoded
+            << " dropped " << os.m_dropped << " queue " << os.m_queue_depth << "/" << os.m_queue_capacity
+            << " bytes " << os.m_bytes << std::endl;
+    }
+    snapshot_stats ss = cons->snapshot_counters();
+    std::cout << "snapshots written " << ss.m_written << " dropped " << ss.m_dropped << " failed " << ss.m_failed
+        << " queue " << ss.m_queue_depth << "/" << ss.m_queue_capacity << std::endl;
+}
+
 void refresh_cfg(std::vector<i_decoder_context_ptr>& decoders)
 {
     std::ifstream infile("mstream.conf");
@@ -107,17 +270,13 @@ void refresh_cfg(std::vector<i_decoder_context_ptr>& decoders)
     while (std::getline(infile, line))
     {
         int stream_num = -1;
-        std::string url;
+        std::string arg;
         
-        auto action = process_cmd(line, stream_num, url);
+        auto action = process_cmd(line, stream_num, arg);
         if (action == process_action::skip)
             continue;
-        if (action != process_action::open_url) {
+        if (!apply_stream_action(action, decoders, stream_num, arg))
             std::cout << "wrong config line: " << line << std::endl;
-            continue;
-        }
-        
-        decoders[stream_num]->set_url(url);
     }};
 }
 
@@ -125,19 +284,22 @@ int main(int argc, char **argv)
 {
     initialize_log();
     register_current_thread("main thread");
+    load_app_config("mstream.conf");
     
     app_config_ptr config = std::make_shared<app_config>();
     
-    i_frame_consumer_master_ptr cons = start_consumer_thread();
+    i_output_ptr output = start_output_thread();
+    i_frame_consumer_master_ptr cons = start_consumer_thread(output);
+    i_worker_pool_ptr pool = create_worker_pool(get_app_config().m_decoder_workers, "Decoder");
+    i_worker_pool_ptr io_pool = create_worker_pool(demux_worker_count(), "Demux");
     
-    std::vector<i_decoder_context_ptr> decoders(4);
+    std::vector<i_decoder_context_ptr> decoders(stream_count());
     
-    decoders[stream_pos_tl] = start_decoder_thread(cons, stream_pos_tl);
-    decoders[stream_pos_tr] = start_decoder_thread(cons, stream_pos_tr);
-    decoders[stream_pos_bl] = start_decoder_thread(cons, stream_pos_bl);
-    decoders[stream_pos_br] = start_decoder_thread(cons, stream_pos_br);
+    for (stream_position pos = 0; pos < decoders.size(); ++pos)
+        decoders[pos] = start_decoder(pool, io_pool, cons, pos);
     
     refresh_cfg(decoders);
+    i_stats_dump_ptr stats_dump = start_stats_dump(cons);
     print_help();
     
     while(1) {
@@ -147,9 +309,9 @@ int main(int argc, char **argv)
         std::getline(std::cin, input);
         
         int stream_num = -1;
-        std::string url;
+        std::string arg;
         
-        auto action = process_cmd(input, stream_num, url);
+        auto action = process_cmd(input, stream_num, arg);
         
         if(process_action::exit == action)
             break;
@@ -157,11 +319,35 @@ int main(int argc, char **argv)
         switch(action)
         {
           case process_action::open_url:
-            decoders[stream_num]->set_url(url);
+          case process_action::set_threads:
+          case process_action::pause:
+          case process_action::resume:
+          case process_action::stop:
+          case process_action::seek:
+          case process_action::set_quality:
+          case process_action::record:
+            if (!apply_stream_action(action, decoders, stream_num, arg))
+                print_help();
             break;
         case process_action::cfg:
           refresh_cfg(decoders);
           break;
+        case process_action::snapshot:
+          if (!request_snapshot(cons, arg))
+              print_help();
+          break;
+        case process_action::stats:
+          print_stats(decoders, cons, output);
+          break;
+        case process_action::set_log_level:
+          {
+            log_level level;
+            if (parse_log_level(arg, level))
+                set_log_level(level);
+            else
+                print_help();
+          }
+          break;
           case process_action::help:
           case process_action::error:
             print_help();
@@ -169,26 +355,28 @@ int main(int argc, char **argv)
         }
     }
     
+    // inputs are cancelled first, so no pool thread stays blocked in I/O and joins are quick
+    auto stop_start = std::chrono::steady_clock::now();
+    if (stats_dump)
+        stats_dump->stop();
+    for (auto& dec : decoders)
+        dec->stop();
+    cons->stop();
+    pool->stop();
+    io_pool->stop();
     decoders.clear();
-    cons->set_done();
     cons.reset();
+    pool.reset();
+    io_pool.reset();
     
-    auto start = std::chrono::system_clock::now();
+    std::chrono::duration<double, std::milli> stop_time = std::chrono::steady_clock::now() - stop_start;
+    LOG_CONS("streams stopped in " << (int)stop_time.count() << " ms");
     
-    int last_diff = 0;
-    while(!g_unloaded) {
-        std::chrono::duration<double> diff = std::chrono::system_clock::now()-start;
-        if (last_diff != (int)diff.count()) {
-            last_diff = (int)diff.count();
-            LOG_CONS("waiting uloading " << last_diff << "...");
-        }
-        if (diff.count() > 10) {
-            LOG_CONS("force quit");
-            break;
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(20));
-    }
+    // consumer is gone, encode what is left and finalize the file
+    if (output)
+        output->stop();
     
+    shutdown_log();
     return 0;
 }
 
@@ -0,0 +1,222 @@
+#include "stream_info.h"
+#include "worker_pool.h"
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <map>
+#include <cstdio>
+#include <algorithm>
+#include <fnmatch.h>
+
+namespace mstream
+{
+
+namespace
+{
+
+bool operator==(const cached_stream_info& a, const cached_stream_info& b)
+{
+    return a.m_stream_index == b.m_stream_index && a.m_codec == b.m_codec
+        && a.m_width == b.m_width && a.m_height == b.m_height && a.m_pix_fmt == b.m_pix_fmt
+        && a.m_fps_num == b.m_fps_num && a.m_fps_den == b.m_fps_den && a.m_extradata == b.m_extradata;
+}
+
+std::string to_hex(const std::vector<uint8_t>& data)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(data.size() * 2);
+    for (uint8_t b : data) {
+        hex += digits[b >> 4];
+        hex += digits[b & 0xf];
+    }
+    return hex;
+}
+
+bool from_hex(const std::string& hex, std::vector<uint8_t>& data)
+{
+    if (hex == "-") {
+        data.clear();
+        return true;
+    }
+    if (hex.size() % 2)
+        return false;
+
+    data.resize(hex.size() / 2);
+    for (size_t i = 0; i < data.size(); ++i) {
+        unsigned b;
+        if (sscanf(hex.c_str() + i * 2, "%2x", &b) != 1)
+            return false;
+        data[i] = (uint8_t)b;
+    }
+    return true;
+}
+
+// one line per url, fields are separated by tabs, urls never contain them:
+// url index codec WxH pix_fmt num/den extradata_hex|-
+// lines go from least to most recently used
+class stream_info_cache
+{
+    struct entry
+    {
+        cached_stream_info m_info;
+        uint64_t m_used = 0;
+    };
+
+    std::mutex m_mx;
+    bool m_loaded = false;              // guarded by m_mx
+    bool m_save_pending = false;        // guarded by m_mx
+    uint64_t m_clock = 0;               // guarded by m_mx, last m_used
+    std::map<std::string, entry> m_entries;     // guarded by m_mx
+    std::mutex m_file_mx;               // one save at a time
+public:
+    bool find(const std::string& url, cached_stream_info& info)
+    {
+        std::unique_lock<std::mutex> lock(m_mx);
+        load();
+        auto it = m_entries.find(url);
+        if (it == m_entries.end())
+            return false;
+        it->second.m_used = ++m_clock;
+        info = it->second.m_info;
+        return true;
+    }
+
+    // true if the caller has to run save()
+    bool store(const std::string& url, const cached_stream_info& info)
+    {
+        std::unique_lock<std::mutex> lock(m_mx);
+        load();
+        entry& e = m_entries[url];
+        e.m_used = ++m_clock;
+        if (e.m_info == info)
+            return false;
+        e.m_info = info;
+        evict();
+
+        if (m_save_pending)
+            return false;
+        m_save_pending = true;
+        return true;
+    }
+
+    // written next to the target and renamed, a reader never sees half of the file
+    void save()
+    {
+        std::unique_lock<std::mutex> file_lock(m_file_mx);
+        std::vector< std::pair<std::string, entry> > entries;
+        {
+            std::unique_lock<std::mutex> lock(m_mx);
+            m_save_pending = false;
+            entries.assign(m_entries.begin(), m_entries.end());
+        }
+        std::sort(entries.begin(), entries.end(),
+            [](const std::pair<std::string, entry>& a, const std::pair<std::string, entry>& b){
+                return a.second.m_used < b.second.m_used;
+            });
+
+        const std::string& file_name = get_app_config().m_stream_cache;
+        std::string tmp_name = file_name + ".tmp";
+        {
+            std::ofstream out(tmp_name);
+            for (const auto& e : entries) {
+                const cached_stream_info& info = e.second.m_info;
+                out << e.first << '\t' << info.m_stream_index << '\t' << info.m_codec
+                    << '\t' << info.m_width << 'x' << info.m_height << '\t' << info.m_pix_fmt
+                    << '\t' << info.m_fps_num << '/' << info.m_fps_den
+                    << '\t' << (info.m_extradata.empty() ? "-" : to_hex(info.m_extradata)) << '\n';
+            }
+            if (!out) {
+                LOG("cannot write " << tmp_name);
+                return;
+            }
+        }
+
+        if (std::rename(tmp_name.c_str(), file_name.c_str()))
+            LOG("cannot rename " << tmp_name << " to " << file_name);
+    }
+
+private:
+    void evict()
+    {
+        size_t limit = get_app_config().m_stream_cache_size;
+        while (m_entries.size() > limit) {
+            auto oldest = std::min_element(m_entries.begin(), m_entries.end(),
+                [](const std::pair<const std::string, entry>& a, const std::pair<const std::string, entry>& b){
+                    return a.second.m_used < b.second.m_used;
+                });
+            m_entries.erase(oldest);
+        }
+    }
+
+    void load()
+    {
+        if (m_loaded)
+            return;
+        m_loaded = true;
+
+        std::ifstream in(get_app_config().m_stream_cache);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::vector<std::string> fields;
+            std::istringstream f(line);
+            std::string field;
+            while (std::getline(f, field, '\t'))
+                fields.push_back(field);
+            if (fields.size() != 7)
+                continue;
+
+            cached_stream_info info;
+            char sep1 = 0, sep2 = 0;
+            std::istringstream size(fields[3]), fps(fields[5]);
+            size >> info.m_width >> sep1 >> info.m_height;
+            fps >> info.m_fps_num >> sep2 >> info.m_fps_den;
+            info.m_codec = fields[2];
+            info.m_pix_fmt = fields[4];
+            try {
+                info.m_stream_index = std::stoi(fields[1]);
+            } catch(...) {
+                continue;
+            }
+            if (size.fail() || fps.fail() || sep1 != 'x' || sep2 != '/' || !from_hex(fields[6], info.m_extradata))
+                continue;
+
+            entry& e = m_entries[fields[0]];
+            e.m_info = info;
+            e.m_used = ++m_clock;
+        }
+        evict();
+        LOG("stream info cache " << m_entries.size() << " urls");
+    }
+};
+
+stream_info_cache g_cache;
+
+}
+
+probe_rule find_probe_rule(const std::string& url)
+{
+    for (const probe_rule& rule : get_app_config().m_probe_rules) {
+        if (!fnmatch(rule.m_pattern.c_str(), url.c_str(), 0))
+            return rule;
+    }
+    return probe_rule();
+}
+
+bool find_cached_stream_info(const std::string& url, cached_stream_info& info)
+{
+    if (get_app_config().m_stream_cache.empty())
+        return false;
+    return g_cache.find(url, info);
+}
+
+void store_cached_stream_info(std::shared_ptr<i_worker_pool> pool, const std::string& url,
+                              const cached_stream_info& info)
+{
+    if (get_app_config().m_stream_cache.empty() || url.find('\t') != std::string::npos)
+        return;
+    if (g_cache.store(url, info))
+        pool->post([](){g_cache.save();});
+}
+
+}
@@ -0,0 +1,274 @@
+#include "worker_pool.h"
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <atomic>
+
+#include "common.h"
+
+namespace mstream
+{
+
+class worker_pool : public i_worker_pool
+{
+    typedef std::function<void()> task;
+    typedef std::chrono::steady_clock clock;
+
+    struct worker
+    {
+        std::mutex m_mx;
+        std::deque<task> m_tasks;
+    };
+
+    struct delayed_task
+    {
+        clock::time_point m_time;
+        task m_task;
+        bool operator<(const delayed_task& other) const {return m_time > other.m_time;}
+    };
+
+    const std::string m_name;
+    std::vector< std::unique_ptr<worker> > m_workers;
+    std::vector<std::thread> m_threads;
+    std::atomic<size_t> m_next_worker;
+
+    // guards m_queued changes done for sleeping workers, and the delayed tasks
+    std::mutex m_idle_mx;
+    std::condition_variable m_idle_cv;
+    std::atomic<size_t> m_queued;
+    std::priority_queue<delayed_task> m_delayed;
+    bool m_stop = false;
+    size_t m_running = 0;           // threads not exited yet
+
+    static thread_local worker_pool* t_pool;
+    static thread_local size_t t_index;
+public:
+    worker_pool(size_t threads, const std::string& name)
+        : m_name(name)
+        , m_next_worker(0)
+        , m_queued(0)
+    {
+        if (!threads)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        for (size_t i = 0; i < threads; ++i)
+            m_workers.emplace_back(new worker());
+    }
+
+    ~worker_pool()
+    {
+        stop();
+        LOG("~worker_pool " << m_name);
+    }
+
+    // workers are joined by stop() or the destructor, the pool must not be released by its own task
+    void start_threads()
+    {
+        m_running = m_workers.size();
+        for (size_t i = 0; i < m_workers.size(); ++i) {
+            m_threads.emplace_back([this, i](){
+                register_current_thread(m_name + std::to_string(i));
+                work(i);
+                LOG("Thread stopped " << std::this_thread::get_id());
+                exited();
+            });
+        }
+    }
+
+    virtual void post(const std::function<void()>& t)
+    {
+        {
+            // counted before push, so a sleeping worker can't miss the task
+            std::unique_lock<std::mutex> lock(m_idle_mx);
+            if (m_stop)
+                return;
+            ++m_queued;
+        }
+
+        size_t index = t_pool == this ? t_index : m_next_worker++ % m_workers.size();
+        {
+            std::unique_lock<std::mutex> lock(m_workers[index]->m_mx);
+            m_workers[index]->m_tasks.push_back(t);
+        }
+
+        m_idle_cv.notify_one();
+    }
+
+    virtual void post_after(std::chrono::milliseconds delay, const std::function<void()>& t)
+    {
+        std::unique_lock<std::mutex> lock(m_idle_mx);
+        if (m_stop)
+            return;
+
+        bool earliest = m_delayed.empty() || clock::now() + delay < m_delayed.top().m_time;
+        delayed_task dt;
+        dt.m_time = clock::now() + delay;
+        dt.m_task = t;
+        m_delayed.push(dt);
+
+        if (earliest)
+            m_idle_cv.notify_one();
+    }
+
+    virtual size_t size() const
+    {
+        return m_workers.size();
+    }
+
+    virtual void stop()
+    {
+        std::priority_queue<delayed_task> delayed;
+        {
+            std::unique_lock<std::mutex> lock(m_idle_mx);
+            if (m_stop)
+                return;
+            m_stop = true;
+            std::swap(delayed, m_delayed);
+            m_idle_cv.notify_all();
+        }
+
+        // tasks keep shared pointers to their owners, break the cycles here
+        for (auto& w : m_workers) {
+            std::unique_lock<std::mutex> lock(w->m_mx);
+            w->m_tasks.clear();
+        }
+
+        // tasks cancel their I/O before the pool is stopped, so workers finish current task soon;
+        // a slow one is reported but still waited for
+        {
+            std::unique_lock<std::mutex> lock(m_idle_mx);
+            if (!m_idle_cv.wait_for(lock, std::chrono::milliseconds(get_app_config().m_stop_timeout_ms),
+                    [this](){return !m_running;}))
+                LOG_CONS(m_name << " pool: " << m_running << " threads didn't stop in "
+                    << get_app_config().m_stop_timeout_ms << " ms, waiting");
+        }
+
+        for (auto& th : m_threads) {
+            if (th.joinable())
+                th.join();
+        }
+    }
+
+private:
+    void exited()
+    {
+        std::unique_lock<std::mutex> lock(m_idle_mx);
+        --m_running;
+        m_idle_cv.notify_all();
+    }
+
+    bool pop_task(size_t index, task& t)
+    {
+        {
+            worker& own = *m_workers[index];
+            std::unique_lock<std::mutex> lock(own.m_mx);
+            // oldest first, a task reposting itself goes behind the others
+            if (!own.m_tasks.empty()) {
+                t = std::move(own.m_tasks.front());
+                own.m_tasks.pop_front();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < m_workers.size(); ++i) {
+            worker& victim = *m_workers[(index + i) % m_workers.size()];
+            std::unique_lock<std::mutex> lock(victim.m_mx);
+            if (!victim.m_tasks.empty()) {
+                t = std::move(victim.m_tasks.front());
+                victim.m_tasks.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // due delayed tasks go to the worker's deque, so they compete with queued tasks instead of waiting for idle
+    void move_due_tasks(size_t index)
+    {
+        std::vector<task> due;
+        {
+            std::unique_lock<std::mutex> lock(m_idle_mx);
+            clock::time_point now = clock::now();
+            while (!m_stop && !m_delayed.empty() && m_delayed.top().m_time <= now) {
+                due.push_back(m_delayed.top().m_task);
+                m_delayed.pop();
+                ++m_queued;
+            }
+        }
+        if (due.empty())
+            return;
+
+        {
+            std::unique_lock<std::mutex> lock(m_workers[index]->m_mx);
+            // they are late already, so they go first, the earliest in front
+            for (auto it = due.rbegin(); it != due.rend(); ++it)
+                m_workers[index]->m_tasks.push_front(std::move(*it));
+        }
+        // the others may steal them
+        if (due.size() > 1)
+            m_idle_cv.notify_all();
+    }
+
+    // wait for queued or due delayed task, false on stop
+    bool wait_task()
+    {
+        std::unique_lock<std::mutex> lock(m_idle_mx);
+        while (!m_stop) {
+            if (m_queued)
+                return true;
+
+            if (!m_delayed.empty()) {
+                if (m_delayed.top().m_time <= clock::now())
+                    return true;
+                m_idle_cv.wait_until(lock, m_delayed.top().m_time);
+            } else {
+                m_idle_cv.wait(lock);
+            }
+        }
+
+        return false;
+    }
+
+    void work(size_t index)
+    {
+        t_pool = this;
+        t_index = index;
+
+        while (true) {
+            move_due_tasks(index);
+
+            task t;
+            if (!pop_task(index, t)) {
+                if (!wait_task())
+                    break;
+                continue;
+            }
+            --m_queued;
+
+            try
+            {
+                t();
+            }
+            catch(std::exception& e)
+            {
+                LOG_CONS("Exception in " << m_name << " task " << e.what());
+            }
+        }
+    }
+};
+
+thread_local worker_pool* worker_pool::t_pool = nullptr;
+thread_local size_t worker_pool::t_index = 0;
+
+i_worker_pool_ptr create_worker_pool(size_t threads, const std::string& name)
+{
+    auto pool = std::make_shared<worker_pool>(threads, name);
+    pool->start_threads();
+    return pool;
+}
+
+}
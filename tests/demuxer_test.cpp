@@ -0,0 +1,75 @@
+#include "demuxer.h"
+#include "worker_pool.h"
+#include "ffmpeg_afx.h"
+#include "common.h"
+
+#include <vector>
+#include <thread>
+#include <iostream>
+#include <algorithm>
+
+using namespace mstream;
+
+namespace
+{
+
+const int skip_code = 77;
+
+}
+
+// more inputs than io workers, none of them may stay unread; lavfi test sources
+// are always ready, so every read task reposts itself like a fast network input
+int main()
+{
+    const size_t streams = 6;
+    const size_t io_workers = 2;
+
+    set_app_config("grid", "3x2");
+    // reading never parks, reposts alone decide who gets the workers
+    set_app_config("packet_queue", "1048576 1024");
+    avdevice_register_all();
+
+    const AVInputFormat* lavfi = av_find_input_format("lavfi");
+    if (!lavfi) {
+        std::cout << "lavfi input is not available" << std::endl;
+        return skip_code;
+    }
+
+    i_worker_pool_ptr io_pool = create_worker_pool(io_workers, "Demux");
+    std::vector<i_demuxer_ptr> demuxers;
+    for (stream_position pos = 0; pos < streams; ++pos) {
+        io_interrupt_ptr interrupt = std::make_shared<io_interrupt>();
+        AVFormatContext* fmt = avformat_alloc_context();
+        interrupt->attach(fmt);
+        if (avformat_open_input(&fmt, "testsrc=size=16x16:rate=1000", const_cast<AVInputFormat*>(lavfi), nullptr) < 0
+            || avformat_find_stream_info(fmt, nullptr) < 0) {
+            std::cout << "cannot open test source" << std::endl;
+            avformat_close_input(&fmt);
+            io_pool->stop();
+            return skip_code;
+        }
+        demuxers.push_back(start_demuxer(io_pool, fmt, interrupt, 0, pos, [](){},
+                                         std::make_shared< std::atomic<int64_t> >(0)));
+    }
+
+    std::vector<long> packets(streams, 0);
+    auto start = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - start < std::chrono::seconds(1)) {
+        for (size_t i = 0; i < streams; ++i) {
+            AVPacketPtr packet;
+            while (demuxers[i]->pop(packet) == demux_event::packet)
+                ++packets[i];
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    for (auto& d : demuxers)
+        d->stop();
+    io_pool->stop();
+    demuxers.clear();
+
+    long min_packets = *std::min_element(packets.begin(), packets.end());
+    long max_packets = *std::max_element(packets.begin(), packets.end());
+    std::cout << "packets per stream: min " << min_packets << " max " << max_packets << std::endl;
+    return min_packets > 0 && min_packets * 4 >= max_packets ? 0 : 1;
+}
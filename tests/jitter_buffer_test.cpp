@@ -0,0 +1,80 @@
+#include "jitter_buffer.h"
+#include "common.h"
+
+#include <cmath>
+#include <iostream>
+
+using namespace mstream;
+
+namespace
+{
+
+const double interval = 40;
+
+bool check(bool ok, const char* what)
+{
+    std::cout << what << ": " << (ok ? "ok" : "FAILED") << std::endl;
+    return ok;
+}
+
+// frames arriving in real time, returns presentation time of the last one
+double feed(jitter_buffer& jb, double& media, double& arrival, int frames)
+{
+    double present = 0;
+    for (int i = 0; i < frames; ++i) {
+        present = jb.present_time(media, arrival, interval);
+        media += interval;
+        arrival += interval;
+    }
+    return present;
+}
+
+// source clock steps an hour ahead, next frame is shown a frame later, not an hour
+bool test_forward_jump()
+{
+    jitter_buffer jb;
+    double media = 0, arrival = 100000;
+    double last = feed(jb, media, arrival, 50);
+
+    media += 3600 * 1000;
+    double next = jb.present_time(media, arrival, interval);
+    return check(jb.discontinuities() == 1 && std::fabs(next - (last + interval)) < 1, "forward jump");
+}
+
+// skip_nonkey shows keyframes a GOP apart, they arrive as far apart as their timestamps
+bool test_keyframe_gaps()
+{
+    jitter_buffer jb;
+    double media = 0, arrival = 100000;
+    feed(jb, media, arrival, 50);
+
+    const double gop = 4000;
+    for (int i = 0; i < 10; ++i) {
+        media += gop;
+        arrival += gop;
+        jb.present_time(media, arrival, interval);
+    }
+    return check(jb.discontinuities() == 0, "keyframe gaps");
+}
+
+// looped file starts over from zero
+bool test_backward_jump()
+{
+    jitter_buffer jb;
+    double media = 60000, arrival = 100000;
+    double last = feed(jb, media, arrival, 50);
+
+    media = 0;
+    double next = jb.present_time(media, arrival, interval);
+    return check(jb.discontinuities() == 1 && std::fabs(next - (last + interval)) < 1, "backward jump");
+}
+
+}
+
+int main()
+{
+    bool ok = test_forward_jump();
+    ok = test_keyframe_gaps() && ok;
+    ok = test_backward_jump() && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,82 @@
+#include "worker_pool.h"
+#include "common.h"
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <iostream>
+#include <algorithm>
+
+using namespace mstream;
+
+namespace
+{
+
+// more always-ready tasks than workers, like decoding with pacing off:
+// every task reposts itself and still none of them may starve
+bool test_fairness()
+{
+    const size_t workers = 2;
+    const size_t tasks = 8;
+
+    i_worker_pool_ptr pool = create_worker_pool(workers, "Test");
+    std::vector< std::atomic<long> > runs(tasks);
+    for (auto& r : runs)
+        r = 0;
+    std::atomic<bool> running(true);
+
+    std::vector< std::function<void()> > bodies(tasks);
+    for (size_t i = 0; i < tasks; ++i) {
+        bodies[i] = [&, i](){
+            ++runs[i];
+            if (running)
+                pool->post(bodies[i]);
+        };
+        pool->post(bodies[i]);
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    running = false;
+    pool->stop();
+
+    long min_runs = runs[0], max_runs = runs[0];
+    for (auto& r : runs) {
+        min_runs = std::min(min_runs, r.load());
+        max_runs = std::max(max_runs, r.load());
+    }
+    std::cout << "fairness: min " << min_runs << " max " << max_runs << std::endl;
+    return min_runs > 0 && min_runs * 4 >= max_runs;
+}
+
+// a due delayed task runs while the workers are busy with reposting tasks
+bool test_delayed_while_busy()
+{
+    i_worker_pool_ptr pool = create_worker_pool(1, "Test");
+    std::atomic<bool> running(true);
+    std::atomic<bool> fired(false);
+
+    std::function<void()> busy = [&](){
+        if (running)
+            pool->post(busy);
+    };
+    pool->post(busy);
+    pool->post_after(std::chrono::milliseconds(50), [&](){fired = true;});
+
+    auto start = std::chrono::steady_clock::now();
+    while (!fired && std::chrono::steady_clock::now() - start < std::chrono::seconds(2))
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    running = false;
+    pool->stop();
+
+    std::cout << "delayed while busy: " << (fired ? "fired" : "starved") << std::endl;
+    return fired;
+}
+
+}
+
+int main()
+{
+    bool ok = test_fairness();
+    ok = test_delayed_while_busy() && ok;
+    return ok ? 0 : 1;
+}